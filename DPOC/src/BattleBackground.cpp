@@ -20,7 +20,7 @@ namespace
 
       while (px >= 0 && px < map->getWidth())
       {
-        Tile* wallTile = map->getTileAt(px, y, "wall");
+        Tile* wallTile = map->getTileAt(px, y, LAYER_WALL);
         if (wallTile && wallTile->tileId >= 0)
         {
           return wallTile;
@@ -34,7 +34,7 @@ namespace
       int py = y;
       while (py >= 0 && py < map->getHeight())
       {
-        Tile* wallTile = map->getTileAt(x, py, "wall");
+        Tile* wallTile = map->getTileAt(x, py, LAYER_WALL);
         if (wallTile && wallTile->tileId >= 0)
         {
           return wallTile;
@@ -53,16 +53,17 @@ BattleBackground::BattleBackground(Map* sourceMap, int x, int y, Direction playe
    m_camera(Vec2((float)MAP_SIZE / 2, (float)MAP_SIZE / 2), Vec2(-1, 0), Vec2(0, -0.66f))
 {
   m_raycaster->setTilemap(m_currentMap);
+  m_raycasterTexture.create(config::RAYCASTER_RES_X, config::RAYCASTER_RES_Y);
 
   Tile* wallTile  = findWallTile(sourceMap, x, y, playerDir);
-  Tile* floorTile = sourceMap->getTileAt(x, y, "floor");
-  Tile* ceilTile  = sourceMap->getTileAt(x, y, "ceiling");
+  Tile* floorTile = sourceMap->getTileAt(x, y, LAYER_FLOOR);
+  Tile* ceilTile  = sourceMap->getTileAt(x, y, LAYER_CEILING);
   for (int py = 0; py < m_currentMap->getHeight(); py++)
   {
     for (int px = 0; px < m_currentMap->getWidth(); px++)
     {
-      m_currentMap->setTileAt(px, py, "floor", floorTile->tileId);
-      m_currentMap->setTileAt(px, py, "ceiling", ceilTile->tileId);
+      m_currentMap->setTileAt(px, py, LAYER_FLOOR, floorTile->tileId);
+      m_currentMap->setTileAt(px, py, LAYER_CEILING, ceilTile->tileId);
     }
   }
 
@@ -70,15 +71,15 @@ BattleBackground::BattleBackground(Map* sourceMap, int x, int y, Direction playe
   {
     int h = m_currentMap->getHeight() - 1;
 
-    m_currentMap->setTileAt(px, 0, "wall", wallTile->tileId);
-    m_currentMap->setTileAt(px, h, "wall", wallTile->tileId);
+    m_currentMap->setTileAt(px, 0, LAYER_WALL, wallTile->tileId);
+    m_currentMap->setTileAt(px, h, LAYER_WALL, wallTile->tileId);
   }
   for (int py = 0; py < m_currentMap->getHeight(); py++)
   {
     int w = m_currentMap->getWidth() - 1;
 
-    m_currentMap->setTileAt(0, py, "wall", wallTile->tileId);
-    m_currentMap->setTileAt(w, py, "wall", wallTile->tileId);
+    m_currentMap->setTileAt(0, py, LAYER_WALL, wallTile->tileId);
+    m_currentMap->setTileAt(w, py, LAYER_WALL, wallTile->tileId);
   }
 }
 
@@ -90,10 +91,8 @@ BattleBackground::~BattleBackground()
 
 const sf::Texture& BattleBackground::getBackgroundTexture()
 {
-  m_raycasterBuffer.create(config::RAYCASTER_RES_X, config::RAYCASTER_RES_Y, sf::Color::Black);
-  m_raycaster->raycast(&m_camera, m_raycasterBuffer);
-
-  m_raycasterTexture.loadFromImage(m_raycasterBuffer);
+  m_raycaster->raycast(&m_camera);
+  m_raycasterTexture.update(m_raycaster->getPixels());
 
   return m_raycasterTexture;
 }
@@ -22,7 +22,6 @@ public:
 
   const sf::Texture& getBackgroundTexture();
 private:
-  sf::Image m_raycasterBuffer;
   sf::Texture m_raycasterTexture;
 
   Raycaster* m_raycaster;
@@ -3,6 +3,7 @@
 
 #include "Config.h"
 #include "logger.h"
+#include "Tileset.h"
 #include "Cache.h"
 
 namespace cache
@@ -15,6 +16,8 @@ namespace cache
   };
 
   static std::map< std::string, Entry<sf::Texture> > textures;
+  static std::map< std::string, Entry<sf::Image> > images;
+  static std::map< std::string, Entry<Tileset> > tilesets;
   static std::map< std::string, sf::SoundBuffer > soundBuffers;
 
   sf::Texture* loadTexture(const std::string& textureName)
@@ -50,6 +53,32 @@ namespace cache
     }
   }
 
+  sf::Texture* loadTextureFromImage(const std::string& textureName, const sf::Image& image)
+  {
+    auto it = textures.find(textureName);
+    if (it != textures.end())
+    {
+      it->second.ref++;
+
+      return it->second.resource;
+    }
+
+    Entry<sf::Texture> newEntry;
+    newEntry.resource = new sf::Texture;
+
+    if (!newEntry.resource->loadFromImage(image))
+    {
+      TRACE("Unable to create texture: %s", textureName.c_str());
+      delete newEntry.resource;
+      return 0;
+    }
+
+    newEntry.ref = 1;
+    textures[textureName] = newEntry;
+
+    return newEntry.resource;
+  }
+
   void releaseTexture(const std::string& textureName)
   {
     auto it = textures.find(textureName);
@@ -99,6 +128,120 @@ namespace cache
     return "";
   }
 
+  sf::Image* loadImage(const std::string& imageName)
+  {
+    auto it = images.find(imageName);
+    if (it == images.end())
+    {
+      Entry<sf::Image> newEntry;
+      newEntry.resource = new sf::Image;
+
+      if (!newEntry.resource->loadFromFile(config::res_path(imageName)))
+      {
+        TRACE("Unable to load image: %s", imageName.c_str());
+        delete newEntry.resource;
+        return 0;
+      }
+
+      newEntry.ref = 1;
+      images[imageName] = newEntry;
+
+      return newEntry.resource;
+    }
+    else
+    {
+      it->second.ref++;
+
+      return it->second.resource;
+    }
+  }
+
+  void releaseImage(const std::string& imageName)
+  {
+    auto it = images.find(imageName);
+    if (it != images.end())
+    {
+      it->second.ref--;
+
+      if (it->second.ref <= 0)
+      {
+        delete it->second.resource;
+        images.erase(it);
+      }
+    }
+    else
+    {
+      TRACE("Attempting to release image %s that has not been previously loaded.", imageName.c_str());
+    }
+  }
+
+  Tileset* loadTileset(const std::string& tilesetName)
+  {
+    auto it = tilesets.find(tilesetName);
+    if (it == tilesets.end())
+    {
+      Entry<Tileset> newEntry;
+      newEntry.resource = new Tileset;
+
+      if (!newEntry.resource->loadFromFile(config::res_path(tilesetName), config::TILE_W, config::TILE_H))
+      {
+        TRACE("Unable to load tileset: %s", tilesetName.c_str());
+        delete newEntry.resource;
+        return 0;
+      }
+
+      newEntry.ref = 1;
+      tilesets[tilesetName] = newEntry;
+
+      return newEntry.resource;
+    }
+    else
+    {
+      it->second.ref++;
+
+      return it->second.resource;
+    }
+  }
+
+  Tileset* loadTileset(const std::string& tilesetName, const sf::Image& image)
+  {
+    auto it = tilesets.find(tilesetName);
+    if (it != tilesets.end())
+    {
+      it->second.ref++;
+
+      return it->second.resource;
+    }
+
+    Entry<Tileset> newEntry;
+    newEntry.resource = new Tileset;
+    newEntry.resource->create(image, config::TILE_W, config::TILE_H);
+
+    newEntry.ref = 1;
+    tilesets[tilesetName] = newEntry;
+
+    return newEntry.resource;
+  }
+
+  void releaseTileset(const std::string& tilesetName)
+  {
+    auto it = tilesets.find(tilesetName);
+    if (it != tilesets.end())
+    {
+      it->second.ref--;
+
+      if (it->second.ref <= 0)
+      {
+        delete it->second.resource;
+        tilesets.erase(it);
+      }
+    }
+    else
+    {
+      TRACE("Attempting to release tileset %s that has not been previously loaded.", tilesetName.c_str());
+    }
+  }
+
   sf::SoundBuffer& loadSound(const std::string& sndFile)
   {
     auto it = soundBuffers.find(sndFile);
@@ -6,14 +6,34 @@
 #include <SFML/Graphics.hpp>
 #include <SFML/Audio.hpp>
 
+class Tileset;
+
 namespace cache
 {
   sf::Texture* loadTexture(const std::string& textureName);
+
+  /// Like loadTexture, but creates the texture from an already decoded image
+  /// of the file if it isn't cached.
+  sf::Texture* loadTextureFromImage(const std::string& textureName, const sf::Image& image);
   void releaseTexture(const std::string& textureName);
   void releaseTexture(sf::Texture* texture);
 
   std::string getTextureName(sf::Texture* texture);
 
+  /// CPU side copy of an image file. Use these instead of copyToImage on a
+  /// texture to avoid reading back from the GPU.
+  sf::Image* loadImage(const std::string& imageName);
+  void releaseImage(const std::string& imageName);
+
+  /// CPU side atlas of a tileset image, cut into tiles of the current
+  /// config::TILE_W * TILE_H. Shared by maps, the raycaster and tile sprites.
+  Tileset* loadTileset(const std::string& tilesetName);
+
+  /// Like loadTileset, but copies an already decoded image of the file if
+  /// it isn't cached.
+  Tileset* loadTileset(const std::string& tilesetName, const sf::Image& image);
+  void releaseTileset(const std::string& tilesetName);
+
   sf::SoundBuffer& loadSound(const std::string& sndFile);
 }
 
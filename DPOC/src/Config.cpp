@@ -3,6 +3,7 @@
 
 #include "Config.h"
 #include "logger.h"
+#include "Utility.h"
 
 #include "../dep/tinyxml2.h"
 
@@ -55,4 +56,16 @@ namespace config
   {
     return CONFIG.count(key);
   }
+
+  int getInt(const std::string& key, int defaultValue)
+  {
+    auto it = CONFIG.find(key);
+    return (it == CONFIG.end() || it->second.empty()) ? defaultValue : fromString<int>(it->second);
+  }
+
+  float getFloat(const std::string& key, float defaultValue)
+  {
+    auto it = CONFIG.find(key);
+    return (it == CONFIG.end() || it->second.empty()) ? defaultValue : fromString<float>(it->second);
+  }
 }
@@ -29,6 +29,10 @@ namespace config
   void set(const std::string& key, const std::string& value);
   bool isSet(const std::string& key);
 
+  /// Numeric value of key, or defaultValue if it isn't set.
+  int getInt(const std::string& key, int defaultValue);
+  float getFloat(const std::string& key, float defaultValue);
+
   inline std::string res_path(const std::string& path)
   {
     return RESOURCE_DIR + path;
@@ -25,7 +25,8 @@ Entity::Entity()
   m_waitCounter(0),
   m_walkThrough(false),
   m_visible(true),
-  m_fixedDirection(false)
+  m_fixedDirection(false),
+  m_map(0)
 {
 }
 
@@ -41,7 +42,8 @@ Entity::Entity(const std::string& name)
    m_waitCounter(0),
    m_walkThrough(false),
    m_visible(true),
-   m_fixedDirection(false)
+   m_fixedDirection(false),
+   m_map(0)
 {
 }
 
@@ -75,6 +77,21 @@ void Entity::loadScripts(const std::string& talkScript, const std::string& stepS
   }
 }
 
+std::vector<std::string> Entity::getTransferTargets() const
+{
+  std::vector<std::string> targets;
+
+  const Script* scripts[] = { &m_script, &m_stepScript, &m_creationScript };
+
+  for (auto script : scripts)
+  {
+    std::vector<std::string> scriptTargets = script->getTransferTargets();
+    targets.insert(targets.end(), scriptTargets.begin(), scriptTargets.end());
+  }
+
+  return targets;
+}
+
 void Entity::update()
 {
   if (m_state == STATE_WALKING)
@@ -161,10 +178,28 @@ void Entity::setDirection(Direction dir)
   }
 }
 
+void Entity::setPosition(int _x, int _y)
+{
+  int oldX = x;
+  int oldY = y;
+  int oldTargetX = m_targetX;
+  int oldTargetY = m_targetY;
+
+  x = _x;
+  y = _y;
+  m_targetX = x;
+  m_targetY = y;
+
+  updateIndex(oldX, oldY, oldTargetX, oldTargetY);
+}
+
 void Entity::step(Direction dir)
 {
   if (m_state != STATE_WALKING)
   {
+    int oldTargetX = m_targetX;
+    int oldTargetY = m_targetY;
+
     setDirection(dir);
 
     if (m_direction == DIR_RIGHT)
@@ -188,12 +223,17 @@ void Entity::step(Direction dir)
     else
     {
       m_state = STATE_WALKING;
+
+      updateIndex(x, y, oldTargetX, oldTargetY);
     }
   }
 }
 
 void Entity::walk()
 {
+  int oldX = x;
+  int oldY = y;
+
   if (m_direction == DIR_RIGHT)
   {
     x += m_speed;
@@ -230,6 +270,21 @@ void Entity::walk()
       m_state = STATE_NORMAL;
     }
   }
+
+  if ((int)x != oldX || (int)y != oldY)
+  {
+    updateIndex(oldX, oldY, m_targetX, m_targetY);
+  }
+}
+
+void Entity::updateIndex(int oldX, int oldY, int oldTargetX, int oldTargetY)
+{
+  if (!m_map)
+    return;
+
+  m_map->removeFromIndex(this, oldX, oldY);
+  m_map->removeFromIndex(this, oldTargetX, oldTargetY);
+  m_map->addToIndex(this);
 }
 
 void Entity::wait(int duration)
@@ -345,22 +400,33 @@ bool Entity::checkEntityCollision() const
 
   Map* map = Game::instance().getCurrentMap();
 
-  for (auto it = map->getEntities().begin(); it != map->getEntities().end(); ++it)
+  // Anything this entity can collide with is indexed at its position or
+  // at its target.
+  const std::vector<Entity*>* candidates[] =
   {
-    if ((*it) == this || (*it)->m_walkThrough)
-      continue;
+    &map->getEntitiesAt(x, y),
+    &map->getEntitiesAt(getTargetX(), getTargetY())
+  };
 
-    int px = (*it)->x;
-    int py = (*it)->y;
+  for (const std::vector<Entity*>* entities : candidates)
+  {
+    for (auto it = entities->begin(); it != entities->end(); ++it)
+    {
+      if ((*it) == this || (*it)->m_walkThrough)
+        continue;
+
+      int px = (*it)->x;
+      int py = (*it)->y;
 
-    if (px == x && py == y)
-      return true;
+      if (px == x && py == y)
+        return true;
 
-    if (px == getTargetX() && py == getTargetY())
-      return true;
+      if (px == getTargetX() && py == getTargetY())
+        return true;
 
-    if (getTargetX() == (*it)->getTargetX() && getTargetY() == (*it)->getTargetY())
-      return true;
+      if (getTargetX() == (*it)->getTargetX() && getTargetY() == (*it)->getTargetY())
+        return true;
+    }
   }
 
   return false;
@@ -12,6 +12,8 @@
 #include "Sprite.h"
 #include "Script.h"
 
+class Map;
+
 struct EntityDef
 {
   std::string name;
@@ -25,6 +27,7 @@ struct EntityDef
 class Entity
 {
   friend class Script;
+  friend class Map;
 
   enum State
   {
@@ -53,13 +56,7 @@ public:
 
   void draw(sf::RenderTarget& target, const coord_t& view);
 
-  void setPosition(int _x, int _y)
-  {
-    x = _x;
-    y = _y;
-    m_targetX = x;
-    m_targetY = y;
-  }
+  void setPosition(int _x, int _y);
 
   float getRealX() const;
   float getRealY() const;
@@ -83,6 +80,9 @@ public:
 
   void loadScripts(const std::string& talkScript, const std::string& stepScript, const std::string& creationScript, const std::unordered_map<std::string, std::string>& arguments);
 
+  /// Maps any of the entity's scripts may transfer the player to.
+  std::vector<std::string> getTransferTargets() const;
+
   void setFixedDirection(bool fixed) { m_fixedDirection = fixed; }
 
   std::string xmlDump() const;
@@ -100,6 +100,9 @@ private:
 
   void walk();
 
+  // Move the entity in its map's index from the tiles it was indexed at.
+  void updateIndex(int oldX, int oldY, int oldTargetX, int oldTargetY);
+
   bool checkPlayerCollision() const;
   bool checkEntityCollision() const;
 private:
@@ -127,6 +130,9 @@ private:
   bool m_walkThrough;
   bool m_visible;
   bool m_fixedDirection;
+
+  // The map whose index the entity is in, if any.
+  Map* m_map;
 };
 
 #endif
@@ -36,6 +36,59 @@
 
 using namespace tinyxml2;
 
+namespace
+{
+  // FNV-1a
+  const uint64_t HASH_OFFSET = 14695981039346656037ULL;
+  const uint64_t HASH_PRIME = 1099511628211ULL;
+
+  template <typename T>
+  void _hash(uint64_t& hash, const T& value)
+  {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+
+    for (size_t i = 0; i < sizeof(T); i++)
+    {
+      hash = (hash ^ bytes[i]) * HASH_PRIME;
+    }
+  }
+
+  // Adaptive raycaster resolution.
+  const float DEFAULT_MIN_SCALE = 0.5f;
+  const float DEFAULT_FRAME_BUDGET = 500.0f / config::FPS;
+  const float MIN_SCALE_LIMIT = 0.125f;
+  const float ADAPTIVE_SCALE_STEP = 0.125f;
+  const int ADAPTIVE_SAMPLE_FRAMES = 30;
+
+  // Memory for maps kept after leaving them, in kilobytes.
+  const int DEFAULT_MAP_CACHE_KB = 4096;
+
+  // Map files the player can get to from map, through warps or scripts.
+  std::vector<std::string> _transfer_targets(const Map* map)
+  {
+    std::vector<std::string> targets;
+
+    for (const Warp& warp : map->getWarps())
+    {
+      targets.push_back(getWarpTargetName(warp));
+    }
+
+    for (const Entity* entity : map->getEntities())
+    {
+      for (const std::string& targetMap : entity->getTransferTargets())
+      {
+        targets.push_back("Maps/" + targetMap);
+      }
+    }
+
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    targets.erase(std::remove(targets.begin(), targets.end(), map->getName()), targets.end());
+
+    return targets;
+  }
+}
+
 Game* Game::theInstance = 0;
 
 Game& Game::instance()
@@ -51,11 +104,13 @@ Game& Game::instance()
 Game::Game()
  : m_currentMap(0),
    m_player(0),
+   m_mapCacheSize(0),
+   m_mapCacheBudget(std::max(0, config::getInt("MAP_CACHE_KB", DEFAULT_MAP_CACHE_KB)) * 1024),
    m_choiceMenu(0),
    m_transferInProgress(false),
    m_playerMoved(false),
    m_camera(Vec2(4.5f, 4.5f), Vec2(-1, 0), Vec2(0, -0.66f)),
-   m_raycaster(new Raycaster(config::RAYCASTER_RES_X, config::RAYCASTER_RES_Y)),
+   m_raycaster(0),
 
    m_isRotating(false),
    m_angleToRotate(0),
@@ -63,14 +118,37 @@ Game::Game()
    m_accumulatedAngle(0),
    m_rotateDegs(0),
 
+   m_viewSignature(0),
+   m_viewValid(false),
+
+   m_raycasterWidth(config::getInt("RAYCASTER_WIDTH", config::RAYCASTER_RES_X)),
+   m_raycasterHeight(config::getInt("RAYCASTER_HEIGHT", config::RAYCASTER_RES_Y)),
+   m_raycasterScale(1.0f),
+   m_adaptiveScale(config::get("RAYCASTER_ADAPTIVE") == "true"),
+   m_minScale(config::getFloat("RAYCASTER_MIN_SCALE", DEFAULT_MIN_SCALE)),
+   m_frameBudget(config::getFloat("RAYCASTER_FRAME_BUDGET", DEFAULT_FRAME_BUDGET)),
+   m_frameTimeSum(0),
+   m_frameCount(0),
+
    m_rotKeyDown(false),
 
    m_minimap(1 + config::GAME_RES_X - 68, 1 + config::GAME_RES_Y - 68, 56, 56),
    m_battleInProgress(false),
    m_campSite(false)
 {
-  m_raycasterBuffer.create(config::RAYCASTER_RES_X, config::RAYCASTER_RES_Y);
-  m_texture.create(config::RAYCASTER_RES_X, config::RAYCASTER_RES_Y);
+  if (m_raycasterWidth < 2 || m_raycasterHeight < 2)
+  {
+    TRACE("Invalid raycaster resolution %dx%d, using %dx%d.",
+          m_raycasterWidth, m_raycasterHeight, config::RAYCASTER_RES_X, config::RAYCASTER_RES_Y);
+
+    m_raycasterWidth = config::RAYCASTER_RES_X;
+    m_raycasterHeight = config::RAYCASTER_RES_Y;
+  }
+
+  m_minScale = std::min(1.0f, std::max(MIN_SCALE_LIMIT, m_minScale));
+
+  m_raycaster = new Raycaster(m_raycasterWidth, m_raycasterHeight);
+  m_texture.create(m_raycasterWidth, m_raycasterHeight);
   m_targetTexture.create(config::RAYCASTER_RES_X, config::RAYCASTER_RES_Y);
 
   // Clear all persistents when a new game is created.
@@ -79,6 +157,7 @@ Game::Game()
 
 Game::~Game()
 {
+  clearMapCache();
   delete m_currentMap;
   delete m_player;
   delete m_choiceMenu;
@@ -286,26 +365,40 @@ void Game::handleKeyPress(sf::Keyboard::Key key)
 
 void Game::draw(sf::RenderTarget& target)
 {
-  for (int y = 0; y < config::RAYCASTER_RES_Y; y++)
-  {
-    for (int x = 0; x < config::RAYCASTER_RES_X; x++)
-    {
-      m_raycasterBuffer.setPixel(x, y, sf::Color::Black);
-    }
-  }
-
   Camera cameraCopy = m_camera.clone();
   cameraCopy.pos.x -= cameraCopy.dir.x * 0.5f;
   cameraCopy.pos.y -= cameraCopy.dir.y * 0.5f;
 
-  m_raycaster->raycast(&cameraCopy, m_raycasterBuffer, m_player->player()->getDirection());
-  m_texture.loadFromImage(m_raycasterBuffer);
+  Direction playerDir = m_player->player()->getDirection();
+
+  // Nothing moved or changed, so the last frame can be used as is.
+  uint64_t signature = computeViewSignature(cameraCopy, playerDir);
+
+  if (!m_viewValid || signature != m_viewSignature)
+  {
+    sf::Clock clock;
+    m_raycaster->raycast(&cameraCopy, playerDir);
+    float frameTime = clock.getElapsedTime().asMicroseconds() / 1000.0f;
+
+    m_texture.update(m_raycaster->getPixels());
+
+    // Stretch to the on screen view size.
+    sf::Sprite raycasterSprite(m_texture);
+    raycasterSprite.setScale((float)config::RAYCASTER_RES_X / m_raycaster->getWidth(),
+                             (float)config::RAYCASTER_RES_Y / m_raycaster->getHeight());
+    m_targetTexture.draw(raycasterSprite);
+    m_targetTexture.display();
 
-  sf::Sprite sprite(m_texture);
-  m_targetTexture.draw(sprite);
-  m_targetTexture.display();
+    m_viewSignature = signature;
+    m_viewValid = true;
 
-  sprite.setTexture(m_targetTexture.getTexture());
+    if (m_adaptiveScale)
+    {
+      adaptRaycasterScale(frameTime);
+    }
+  }
+
+  sf::Sprite sprite(m_targetTexture.getTexture());
   sprite.setPosition(0, 0);
   target.draw(sprite);
 
@@ -342,6 +435,97 @@ void Game::draw(sf::RenderTarget& target)
   }
 }
 
+uint64_t Game::computeViewSignature(const Camera& camera, Direction playerDir) const
+{
+  uint64_t hash = HASH_OFFSET;
+
+  _hash(hash, m_currentMap);
+  _hash(hash, playerDir);
+  _hash(hash, camera.pos.x);
+  _hash(hash, camera.pos.y);
+  _hash(hash, camera.dir.x);
+  _hash(hash, camera.dir.y);
+  _hash(hash, camera.plane.x);
+  _hash(hash, camera.plane.y);
+
+  if (m_currentMap)
+  {
+    _hash(hash, m_currentMap->getRevision());
+    _hash(hash, m_currentMap->getLightRevision());
+
+    for (const Entity* entity : m_currentMap->getEntities())
+    {
+      _hash(hash, entity->x);
+      _hash(hash, entity->y);
+      _hash(hash, entity->isVisible());
+
+      if (const Sprite* sprite = entity->sprite())
+      {
+        // Sprites change image with their frame, their direction and the
+        // direction they are seen from.
+        _hash(hash, &sprite->getImage(playerDir));
+
+        if (const TileSprite* tileSprite = dynamic_cast<const TileSprite*>(sprite))
+        {
+          _hash(hash, tileSprite->getTileNum());
+        }
+      }
+
+      if (const Door* door = dynamic_cast<const Door*>(entity))
+      {
+        _hash(hash, door->isSeeThrough());
+        _hash(hash, door->getOpeningCount());
+      }
+    }
+  }
+
+  return hash;
+}
+
+void Game::setRaycasterScale(float scale)
+{
+  m_raycasterScale = scale;
+
+  // Keep the dimensions even so the horizon stays on a row boundary.
+  int width = std::max(2, (int)(m_raycasterWidth * scale) & ~1);
+  int height = std::max(2, (int)(m_raycasterHeight * scale) & ~1);
+
+  if (width == m_raycaster->getWidth() && height == m_raycaster->getHeight())
+  {
+    return;
+  }
+
+  TRACE("Raycaster resolution changed to %dx%d", width, height);
+
+  m_raycaster->resize(width, height);
+  m_texture.create(width, height);
+  m_viewValid = false;
+}
+
+void Game::adaptRaycasterScale(float frameTime)
+{
+  m_frameTimeSum += frameTime;
+  m_frameCount++;
+
+  if (m_frameCount < ADAPTIVE_SAMPLE_FRAMES)
+  {
+    return;
+  }
+
+  float average = m_frameTimeSum / m_frameCount;
+  m_frameTimeSum = 0;
+  m_frameCount = 0;
+
+  if (average > m_frameBudget && m_raycasterScale > m_minScale)
+  {
+    setRaycasterScale(std::max(m_minScale, m_raycasterScale - ADAPTIVE_SCALE_STEP));
+  }
+  else if (average < m_frameBudget / 2 && m_raycasterScale < 1.0f)
+  {
+    setRaycasterScale(std::min(1.0f, m_raycasterScale + ADAPTIVE_SCALE_STEP));
+  }
+}
+
 void Game::drawParty(sf::RenderTarget& target) const
 {
   int delta = config::GAME_RES_Y - config::RAYCASTER_RES_Y;
@@ -477,22 +661,10 @@ bool Game::checkTraps()
 
 bool Game::checkInteractions()
 {
-  auto entities = m_currentMap->getEntities();
-
   if (m_player && m_currentMap &&
       !m_player->player()->isWalking())
   {
-    Entity* entity = 0;
-
-    for (auto it = entities.begin(); it != entities.end(); ++it)
-    {
-      if ((int)(*it)->x == (int)m_player->player()->x &&
-          (int)(*it)->y == (int)m_player->player()->y)
-      {
-        entity = *it;
-        break;
-      }
-    }
+    Entity* entity = m_currentMap->getEntityAt(m_player->player()->x, m_player->player()->y);
 
     if (entity)
     {
@@ -520,6 +692,9 @@ void Game::transferPlayer(const std::string& targetMap, int x, int y)
 {
   if (targetMap.size() && targetMap != m_currentMap->getName())
   {
+    cacheMap(m_currentMap);
+    m_currentMap = 0;
+
     loadNewMap(targetMap);
   }
 
@@ -565,7 +740,24 @@ void Game::closeChoiceMenu()
 void Game::loadNewMap(const std::string& file)
 {
   delete m_currentMap;
-  m_currentMap = Map::loadTiledFile(file);
+
+  m_currentMap = takeCachedMap(file);
+
+  if (m_currentMap)
+  {
+    TRACE("Map %s taken from the map cache", file.c_str());
+
+    config::TILE_W = m_currentMap->getTileWidth();
+    config::TILE_H = m_currentMap->getTileHeight();
+  }
+  else
+  {
+    PrefetchedMap* prefetched = m_mapPrefetcher.take(file);
+
+    m_currentMap = Map::loadTiledFile(file, prefetched);
+
+    delete prefetched;
+  }
 
   if (!m_currentMap)
   {
@@ -575,6 +767,9 @@ void Game::loadNewMap(const std::string& file)
 
   m_raycaster->setTilemap(m_currentMap);
   m_raycaster->clearEntities();
+
+  // The new map may well end up at the address of the old one.
+  m_viewValid = false;
   for (auto& entity : m_currentMap->getEntities())
   {
     if (entity->sprite() && entity->getType() != "door")
@@ -591,6 +786,87 @@ void Game::loadNewMap(const std::string& file)
   {
     playMusic(m_currentMap->getMusic());
   }
+
+  std::vector<std::string> targets = _transfer_targets(m_currentMap);
+  targets.erase(std::remove_if(targets.begin(), targets.end(),
+                               [this](const std::string& target) { return isMapCached(target); }),
+                targets.end());
+
+  m_mapPrefetcher.prefetch(targets);
+}
+
+void Game::cacheMap(Map* map)
+{
+  if (!map)
+    return;
+
+  CachedMap cached;
+  cached.map = map;
+  cached.size = map->getMemoryUsage();
+
+  m_mapCache.push_front(cached);
+  m_mapCacheSize += cached.size;
+
+  while (!m_mapCache.empty() && m_mapCacheSize > m_mapCacheBudget)
+  {
+    TRACE("Dropping map %s from the map cache", m_mapCache.back().map->getName().c_str());
+
+    // Loading the map again must not put everyone back where they started,
+    // any more than taking it from the cache would.
+    m_mapCache.back().map->saveEntityState();
+
+    m_mapCacheSize -= m_mapCache.back().size;
+    delete m_mapCache.back().map;
+    m_mapCache.pop_back();
+  }
+}
+
+Map* Game::takeCachedMap(const std::string& file)
+{
+  for (auto it = m_mapCache.begin(); it != m_mapCache.end(); ++it)
+  {
+    if (it->map->getName() == file)
+    {
+      Map* map = it->map;
+
+      m_mapCacheSize -= it->size;
+      m_mapCache.erase(it);
+
+      return map;
+    }
+  }
+
+  return 0;
+}
+
+bool Game::isMapCached(const std::string& file) const
+{
+  for (const CachedMap& cached : m_mapCache)
+  {
+    if (cached.map->getName() == file)
+      return true;
+  }
+
+  return false;
+}
+
+void Game::clearMapCache()
+{
+  for (const CachedMap& cached : m_mapCache)
+  {
+    delete cached.map;
+  }
+
+  m_mapCache.clear();
+  m_mapCacheSize = 0;
+}
+
+void Game::saveCachedMapState()
+{
+  for (const CachedMap& cached : m_mapCache)
+  {
+    cached.map->saveEntityState();
+  }
 }
 
 void Game::startBattle(const std::vector<std::string>& monsters, bool canEscape, const std::string& music, const std::vector<std::string>& script)
@@ -3,6 +3,8 @@
 
 #include <vector>
 #include <string>
+#include <list>
+#include <cstdint>
 
 #include <SFML/Audio.hpp>
 #include <SFML/Graphics.hpp>
@@ -14,6 +16,7 @@
 #include "Camera.h"
 
 #include "Minimap.h"
+#include "MapPrefetcher.h"
 
 class Player;
 class Entity;
@@ -43,6 +46,14 @@ public:
 
   void loadNewMap(const std::string& file);
 
+  /// Forget the maps kept from earlier transfers, so they are loaded from
+  /// disk again. Needed when the game state is replaced, e.g. on load.
+  void clearMapCache();
+
+  /// Write the entity state of the cached maps to Persistent, so a save
+  /// has it whether or not the maps were dropped from the cache yet.
+  void saveCachedMapState();
+
   void startBattle(const std::vector<std::string>& monsters, bool canEscape = true, const std::string& music = "", const std::vector<std::string>& script = {});
 
   void preFade(FadeType fadeType);
@@ -77,9 +88,34 @@ private:
   void execRotate();
 
   void drawParty(sf::RenderTarget& target) const;
+
+  uint64_t computeViewSignature(const Camera& camera, Direction playerDir) const;
+
+  void setRaycasterScale(float scale);
+  void adaptRaycasterScale(float frameTime);
+
+  void cacheMap(Map* map);
+  Map* takeCachedMap(const std::string& file);
+  bool isMapCached(const std::string& file) const;
 private:
+  struct CachedMap
+  {
+    Map* map;
+    size_t size;
+  };
   Map* m_currentMap;
   Player* m_player;
+
+  // Loads the maps warps and scripts lead to while the player is busy on
+  // the current one.
+  MapPrefetcher m_mapPrefetcher;
+
+  // Maps the player left, most recently left first, kept as they were so
+  // going back is instant. Least recently left maps are dropped when the
+  // total goes over m_mapCacheBudget bytes.
+  std::list<CachedMap> m_mapCache;
+  size_t m_mapCacheSize;
+  size_t m_mapCacheBudget;
   coord_t m_view;
 
   std::string m_currentMusicName;
@@ -103,10 +139,28 @@ private:
   int m_accumulatedAngle;
   float m_rotateDegs;
 
-  sf::Image m_raycasterBuffer;
   sf::Texture m_texture;
   sf::RenderTexture m_targetTexture;
 
+  // Everything that affects the raycaster output, hashed. Rendering is
+  // skipped when it hasn't changed since the last frame.
+  uint64_t m_viewSignature;
+  bool m_viewValid;
+
+  // Resolution the raycaster renders at, before being scaled to
+  // RAYCASTER_RES_X * RAYCASTER_RES_Y on screen.
+  int m_raycasterWidth;
+  int m_raycasterHeight;
+  float m_raycasterScale;
+
+  // Adaptive mode lowers m_raycasterScale when the raycaster is slower than
+  // the frame budget (ms) and raises it again when there's headroom.
+  bool m_adaptiveScale;
+  float m_minScale;
+  float m_frameBudget;
+  float m_frameTimeSum;
+  int m_frameCount;
+
   bool m_rotKeyDown;
 
   Minimap m_minimap;
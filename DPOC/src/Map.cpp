@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <set>
+#include <cmath>
 
 #include "Chest.h"
 #include "Door.h"
@@ -10,8 +12,11 @@
 #include "Utility.h"
 #include "TiledLoader.h"
 #include "Cache.h"
+#include "Tileset.h"
 #include "logger.h"
 #include "Encounter.h"
+#include "Vec2.h"
+#include "MapPrefetcher.h"
 
 #include "Map.h"
 
@@ -38,17 +43,152 @@ namespace
 
     return scriptArguments;
   }
+
+  // Objects without a tile that Map::loadGeometry turns into warps, traps
+  // and lights rather than entities.
+  bool _is_geometry_object(const std::string& name)
+  {
+    std::string lower = to_lower(name);
+    return lower == "warp" || lower == "trap" || lower == "light";
+  }
+
+  // Textures are created from the prefetched images when there are any.
+  sf::Texture* _load_texture(const std::string& textureName, const PrefetchedMap* prefetched)
+  {
+    if (prefetched)
+    {
+      auto it = prefetched->images.find(textureName);
+
+      if (it != prefetched->images.end())
+      {
+        return cache::loadTextureFromImage(textureName, it->second);
+      }
+    }
+
+    return cache::loadTexture(textureName);
+  }
+
+  Tileset* _load_tileset(const std::string& tilesetName, const PrefetchedMap* prefetched)
+  {
+    if (prefetched)
+    {
+      auto it = prefetched->images.find(tilesetName);
+
+      if (it != prefetched->images.end())
+      {
+        return cache::loadTileset(tilesetName, it->second);
+      }
+    }
+
+    return cache::loadTileset(tilesetName);
+  }
+
+  // Rays cast from each sample point of a tile when computing what can be
+  // seen from it.
+  const int VISIBILITY_RAYS = 512;
+
+  std::vector<Vec2> _visibility_directions()
+  {
+    std::vector<Vec2> directions;
+
+    for (int i = 0; i < VISIBILITY_RAYS; i++)
+    {
+      float angle = deg2rad(360.0f * i / VISIBILITY_RAYS);
+      directions.push_back(Vec2(cos(angle), sin(angle)));
+    }
+
+    return directions;
+  }
+
+  const std::vector<Vec2> VISIBILITY_DIRECTIONS = _visibility_directions();
+
+  // Where in a tile the camera can be, in tile units.
+  const float VISIBILITY_SAMPLES[][2] =
+  {
+    { 0.5f, 0.5f },
+    { 0.05f, 0.05f },
+    { 0.95f, 0.05f },
+    { 0.05f, 0.95f },
+    { 0.95f, 0.95f }
+  };
+
+  // Light levels are capped so the raycaster's fixed point shading can't
+  // overflow. Nothing gets brighter than fully lit anyway.
+  const float MAX_LIGHT = 4.0f;
+
+  // Flickering lights are updated every this many ticks.
+  const unsigned FLICKER_TICKS = 4;
+
+  // Guess at what an entity with its sprite and script costs, for
+  // Map::getMemoryUsage.
+  const size_t ENTITY_SIZE_ESTIMATE = 2048;
+
+  const std::vector<Entity*> NO_ENTITIES;
+
+  int _light_to_fixed(float light)
+  {
+    return static_cast<int>(std::max(0.0f, std::min(light, MAX_LIGHT)) * 256 + 0.5f);
+  }
+
+  // Deterministic flicker between 0.8 and 1.0 so replays and benchmarks
+  // render the same frames.
+  float _flicker(unsigned ticks, size_t lightIndex)
+  {
+    float t = static_cast<float>(ticks / FLICKER_TICKS);
+    float noise = 0.5f + 0.25f * sin(t * 0.9f + lightIndex * 1.7f) + 0.25f * sin(t * 2.3f + lightIndex * 0.4f);
+
+    return 0.8f + 0.2f * noise;
+  }
 }
 
 std::unordered_map<std::string, std::vector<bool>> Map::s_explored;
 
+MapLayer layerFromString(const std::string& layerName)
+{
+  if (layerName == "wall") return LAYER_WALL;
+  else if (layerName == "floor") return LAYER_FLOOR;
+  else if (layerName == "ceiling") return LAYER_CEILING;
+  else if (layerName == "wallfeature") return LAYER_WALLFEATURE;
+
+  return LAYER_NONE;
+}
+
+std::string layerToString(MapLayer layer)
+{
+  switch (layer)
+  {
+  case LAYER_WALL: return "wall";
+  case LAYER_FLOOR: return "floor";
+  case LAYER_CEILING: return "ceiling";
+  case LAYER_WALLFEATURE: return "wallfeature";
+  default:
+    break;
+  }
+
+  return "";
+}
+
 Map::Map()
  : m_width(0),
    m_height(0),
+   m_tileWidth(0),
+   m_tileHeight(0),
    m_encounterRate(0),
    m_tileset(0),
-   m_background(0)
+   m_atlas(0),
+   m_background(0),
+   m_revision(0),
+   m_visibilityStride(0),
+   m_visibilityClustersX(0),
+   m_ambientLight(1.0f),
+   m_lightRevision(0),
+   m_lightTicks(0),
+   m_explored(0)
 {
+  for (int i = 0; i < NUMBER_OF_LAYERS; i++)
+  {
+    m_layers[i] = 0;
+  }
 }
 
 Map::~Map()
@@ -61,49 +201,55 @@ Map::~Map()
   for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
     delete *it;
 
-  cache::releaseTexture(m_tileset);
-  cache::releaseTexture(m_background);
+  // Maps built by the prefetcher and never used are deleted on its thread
+  // and don't have textures, so the cache must not be touched then.
+  if (m_tileset)
+  {
+    cache::releaseTexture(m_tileset);
+  }
+
+  if (m_background)
+  {
+    cache::releaseTexture(m_background);
+  }
+
+  if (m_atlas)
+  {
+    cache::releaseTileset(m_tilesetName);
+  }
 }
 
 void Map::update()
 {
   for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
     (*it)->update();
+
+  updateLights();
 }
 
-Map* Map::loadTiledFile(const std::string& filename)
+Map* Map::loadTiledFile(const std::string& filename, PrefetchedMap* prefetched)
 {
   Map* map = 0;
 
-  TRACE("Loading map %s", filename.c_str());
+  TRACE("Loading map %s%s", filename.c_str(), prefetched ? " (prefetched)" : "");
 
-  TiledLoader loader;
-  if (loader.loadFromFile(config::res_path(filename)))
-  {
-    map = new Map;
-    map->m_name = filename;
-    map->m_music = loader.getProperty("music");
+  TiledLoader fileLoader;
+  bool loaded = prefetched ? prefetched->loaded : fileLoader.load(config::res_path(filename));
+
+  const TiledLoader& loader = prefetched ? prefetched->loader : fileLoader;
 
+  if (loaded)
+  {
     // The tile size is used everywhere so store it in a global.
     config::TILE_W = loader.getTileWidth();
     config::TILE_H = loader.getTileHeight();
 
-    map->m_encounterRate = 30;
-    if (!loader.getProperty("encounterRate").empty())
-    {
-      map->m_encounterRate = fromString<int>(loader.getProperty("encounterRate"));
-    }
-
-    map->m_battleBackground = loader.getProperty("battleBackground");
-
-    std::string bg = loader.getProperty("background");
-    if (bg.size())
-    {
-      map->m_background = cache::loadTexture("Backgrounds/" + bg);
-    }
-
     TRACE("Map: Loading tilesets");
 
+    std::string tilesetName;
+    Tileset* atlas = 0;
+    sf::Texture* tilesetTexture = 0;
+
     std::vector<std::string> tilesets = loader.getTilesets();
     for (auto it = tilesets.begin(); it != tilesets.end(); ++it)
     {
@@ -112,71 +258,56 @@ Map* Map::loadTiledFile(const std::string& filename)
       {
         TRACE("Map: loading tileset %s", config::res_path("Maps/" + tileset->tilesetSource).c_str());
 
-        map->m_tilesetName = "Maps/" + tileset->tilesetSource;
-        map->m_tileset = cache::loadTexture("Maps/" + tileset->tilesetSource);
+        tilesetName = "Maps/" + tileset->tilesetSource;
+        // The texture is made from the tileset's image so the file is only
+        // decoded once.
+        atlas = _load_tileset(tilesetName, prefetched);
+        tilesetTexture = atlas ? cache::loadTextureFromImage(tilesetName, atlas->getImage()) : 0;
 
-        if (!map->m_tileset)
+        if (!tilesetTexture)
         {
           TRACE("Map: Unable to load tileset");
 
-          delete map;
           return 0;
         }
       }
     }
 
-    TRACE("Map: Loading layers");
-
-    std::vector<std::string> layers = loader.getLayers();
-    for (size_t i = 0; i < layers.size(); i++)
+    // Everything that doesn't need textures or scripts was built on the
+    // prefetcher's thread if the map was prefetched.
+    if (prefetched && prefetched->map)
     {
-      // Blocking layer is special.
-      if (to_lower(layers[i]) == "blocking")
-        continue;
-
-      std::string layerName = to_lower(layers[i]);
-
-      const TiledLoader::Layer* layer = loader.getLayer(layers[i]);
-
-      map->m_width = layer->width;
-      map->m_height = layer->height;
-
-      map->m_tiles[layerName] = new Tile[map->m_width * map->m_height]();
+      map = prefetched->map;
+      prefetched->map = 0;
+    }
+    else
+    {
+      map = loadGeometry(filename, loader, tilesetTexture ? tilesetTexture->getSize().x : 0);
+    }
 
-      for (size_t j = 0; j < layer->tiles.size(); j++)
+    if (!map)
+    {
+      if (tilesetTexture)
       {
-        int tileId = layer->tiles[j];
-
-        Tile tile;
-        tile.solid = false;
-        tile.tileX = 0;
-        tile.tileY = 0;
-
-        if (tileId > 0)
-        {
-          tile.tileX = (tileId - 1) % (map->m_tileset->getSize().x / config::TILE_W);
-          tile.tileY = (tileId - 1) / (map->m_tileset->getSize().x / config::TILE_H);
-        }
-        tile.tileId = tileId - 1; // -1 then means no tile.
+        cache::releaseTexture(tilesetTexture);
+      }
 
-        map->m_tiles[layerName][j] = tile;
+      if (atlas)
+      {
+        cache::releaseTileset(tilesetName);
       }
+
+      return 0;
     }
 
-    // Blocking layer
-    for (auto it = layers.begin(); it != layers.end(); ++it)
-    {
-      if (to_lower(*it) == "blocking")
-      {
-        const TiledLoader::Layer* layer = loader.getLayer(*it);
+    map->m_tilesetName = tilesetName;
+    map->m_atlas = atlas;
+    map->m_tileset = tilesetTexture;
 
-        for (size_t i = 0; i < layer->tiles.size(); i++)
-        {
-          int tileId = layer->tiles[i];
-          if (tileId != 0)
-            map->m_tiles["floor"][i].solid = true;
-        }
-      }
+    std::string bg = loader.getProperty("background");
+    if (bg.size())
+    {
+      map->m_background = _load_texture("Backgrounds/" + bg, prefetched);
     }
 
     for (size_t objectIndex = 0; objectIndex < loader.getNumberOfObjects(); objectIndex++)
@@ -190,7 +321,7 @@ Map* Map::loadTiledFile(const std::string& filename)
         if (tileset)
         {
           std::string spriteSheet = "Maps/" + tileset->tilesetSource;
-          sf::Texture* texture = cache::loadTexture(spriteSheet);
+          sf::Texture* texture = _load_texture(spriteSheet, prefetched);
 
           std::string name = object->name;
           float walkSpeed = fromString<float>(loader.getObjectProperty(objectIndex, "walkSpeed"));
@@ -280,101 +411,227 @@ Map* Map::loadTiledFile(const std::string& filename)
           // cache::releaseTexture(texture);
         }
       }
-      else
+      else if (!_is_geometry_object(object->name))
       {
+        // Entities without picture.
         std::string name = object->name;
-        if (to_lower(name) == "warp")
+
+        int objX = object->x / config::TILE_W;
+        int objY = object->y / config::TILE_H;
+
+        if (name.empty())
         {
-          std::string dirStr = loader.getObjectProperty(objectIndex, "direction");
-
-          Warp warp;
-          warp.srcX = object->x / config::TILE_W;
-          warp.srcY = object->y / config::TILE_H;
-          warp.dstX = fromString<int>(loader.getObjectProperty(objectIndex, "destX"));
-          warp.dstY = fromString<int>(loader.getObjectProperty(objectIndex, "destY"));
-          warp.destMap = loader.getObjectProperty(objectIndex, "destMap");
-          warp.dir = dirStr.empty() ? DIR_RANDOM : directionFromString(dirStr);
-          map->m_warps.push_back(warp);
-
-          TRACE("New warp: srcX=%d, srcY=%d, dstX=%d, dstY=%d, dstMap=%s, direction=%s",
-              warp.srcX, warp.srcY, warp.dstX, warp.dstY, warp.destMap.c_str(), dirStr.c_str());
+          name = "anonymous_object@[" + toString(objX) + "," + toString(objY) + "]";
         }
-        else if (to_lower(name) == "trap")
-        {
-          int trapX = object->x / config::TILE_W;
-          int trapY = object->y / config::TILE_H;
 
-          std::string trapType = loader.getObjectType(objectIndex);
-          int trapDifficulty = fromString<int>(loader.getObjectProperty(objectIndex, "difficulty"));
+        Entity* entity = new Entity(name);
+        entity->setPosition(objX, objY);
+        entity->setTag(name + "@@" + map->m_name);
+        entity->setWalkSpeed(0);
+        entity->setWalkThrough(true);
+        entity->setIsVisible(false);
+        entity->setType(loader.getObjectType(objectIndex));
+
+        entity->loadScripts(
+            loader.getObjectProperty(objectIndex, "talkScript"),
+            loader.getObjectProperty(objectIndex, "stepScript"),
+            loader.getObjectProperty(objectIndex, "createScript"),
+            _parse_script_arguments(loader, objectIndex));
+
+        map->m_entities.push_back(entity);
+      }
+    }
 
-          map->m_traps.push_back( Trap { trapType, trapDifficulty, trapX, trapY } );
+    TRACE("Updating explored vector for map");
 
-          TRACE("New trap: trapX=%d, trapY=%d, trapType=%s, difficulty=%d",
-              trapX, trapY, trapType.c_str(), trapDifficulty);
-        }
-        else
-        {
-          // Entities without picture.
-          std::string name = object->name;
+    // Initiate explored vector for this map, unless previously done.
+    // Elements of an unordered_map never move, so the pointer stays valid.
+    map->m_explored = &s_explored[map->getName()];
 
-          int objX = object->x / config::TILE_W;
-          int objY = object->y / config::TILE_H;
+    // If size has changed the map has changed in some way, so reset it.
+    if ((int)map->m_explored->size() != map->getNumberOfTiles())
+    {
+      map->m_explored->assign(map->getNumberOfTiles(), false);
+    }
 
-          if (name.empty())
-          {
-            name = "anonymous_object@[" + toString(objX) + "," + toString(objY) + "]";
-          }
+    map->restoreEntityState();
+    map->buildIndex();
 
-          Entity* entity = new Entity(name);
-          entity->setPosition(objX, objY);
-          entity->setTag(name + "@@" + map->m_name);
-          entity->setWalkSpeed(0);
-          entity->setWalkThrough(true);
-          entity->setIsVisible(false);
-          entity->setType(loader.getObjectType(objectIndex));
+    TRACE("Map loading completed!");
+  }
+  else
+  {
+    TRACE("Unable to open tiled file %s", filename.c_str());
+  }
 
-          entity->loadScripts(
-              loader.getObjectProperty(objectIndex, "talkScript"),
-              loader.getObjectProperty(objectIndex, "stepScript"),
-              loader.getObjectProperty(objectIndex, "createScript"),
-              _parse_script_arguments(loader, objectIndex));
+  return map;
+}
 
-          map->m_entities.push_back(entity);
-        }
-      }
+Map* Map::loadGeometry(const std::string& filename, const TiledLoader& loader, int tilesetWidth)
+{
+  Map* map = new Map;
+  map->m_name = filename;
+  map->m_music = loader.getProperty("music");
+
+  // Not config::TILE_W and TILE_H, this may run on another thread.
+  map->m_tileWidth = loader.getTileWidth();
+  map->m_tileHeight = loader.getTileHeight();
+
+  map->m_encounterRate = 30;
+  if (!loader.getProperty("encounterRate").empty())
+  {
+    map->m_encounterRate = fromString<int>(loader.getProperty("encounterRate"));
+  }
+
+  map->m_battleBackground = loader.getProperty("battleBackground");
+
+  TRACE("Map: Loading layers");
+
+  std::vector<std::string> layers = loader.getLayers();
+
+  // Everything indexes the layers, blocking included, as width * height
+  // tiles, so a layer that doesn't match would be read or written past its
+  // end. Checked here so it holds for every encoding and compiled maps.
+  for (auto it = layers.begin(); it != layers.end(); ++it)
+  {
+    const TiledLoader::Layer* layer = loader.getLayer(*it);
+    const TiledLoader::Layer* first = loader.getLayer(layers.front());
+
+    if (layer->width < 0 || layer->height < 0 ||
+        layer->width != first->width || layer->height != first->height ||
+        layer->tiles.size() != (size_t)layer->width * layer->height)
+    {
+      TRACE("Map: Layer %s is %dx%d with %d tiles, expected %dx%d",
+          it->c_str(), layer->width, layer->height, (int)layer->tiles.size(), first->width, first->height);
+
+      delete map;
+      return 0;
     }
+  }
+
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    // Blocking layer is special.
+    if (to_lower(layers[i]) == "blocking")
+      continue;
 
-    TRACE("Reading encounters");
-    std::string encounters_str = loader.getProperty("encounters");
-    std::vector<std::string> encounters = split_string(encounters_str, ',');
-    map->m_encounters = encounters;
+    std::string layerName = to_lower(layers[i]);
 
-    TRACE(" -> %s", encounters_str.c_str());
+    const TiledLoader::Layer* layer = loader.getLayer(layers[i]);
 
-    TRACE("Updating explored vector for map");
+    map->m_width = layer->width;
+    map->m_height = layer->height;
 
-    // Initiate explored vector for this map, unless previously done.
-    if (s_explored.count(map->getName()) == 0)
+    map->m_tiles[layerName] = new Tile[map->m_width * map->m_height]();
+
+    for (size_t j = 0; j < layer->tiles.size(); j++)
     {
-      s_explored[map->getName()] = std::vector<bool>(map->m_width * map->m_height, false);
+      int tileId = layer->tiles[j];
+
+      Tile tile;
+      tile.solid = false;
+      tile.tileX = 0;
+      tile.tileY = 0;
+
+      if (tileId > 0 && tilesetWidth >= map->m_tileWidth && tilesetWidth >= map->m_tileHeight)
+      {
+        tile.tileX = (tileId - 1) % (tilesetWidth / map->m_tileWidth);
+        tile.tileY = (tileId - 1) / (tilesetWidth / map->m_tileHeight);
+      }
+      tile.tileId = tileId - 1; // -1 then means no tile.
+
+      map->m_tiles[layerName][j] = tile;
     }
-    else
+  }
+
+  map->updateLayers();
+
+  // Blocking layer
+  for (auto it = layers.begin(); it != layers.end(); ++it)
+  {
+    if (to_lower(*it) == "blocking" && map->m_layers[LAYER_FLOOR])
     {
-      // If size has changed the map has changed in some way, so reset it.
-      size_t size = s_explored[map->getName()].size();
-      if ((int)size != map->getWidth() * map->getHeight())
+      const TiledLoader::Layer* layer = loader.getLayer(*it);
+
+      for (size_t i = 0; i < layer->tiles.size(); i++)
       {
-        s_explored[map->getName()] = std::vector<bool>(map->m_width * map->m_height, false);
+        int tileId = layer->tiles[i];
+        if (tileId != 0)
+          map->m_layers[LAYER_FLOOR][i].solid = true;
       }
     }
+  }
 
-    TRACE("Map loading completed!");
+  for (size_t objectIndex = 0; objectIndex < loader.getNumberOfObjects(); objectIndex++)
+  {
+    const TiledLoader::Object* object = loader.getObject(objectIndex);
+    if (object->tileId > 0)
+      continue;
+
+    std::string name = object->name;
+    if (to_lower(name) == "warp")
+    {
+      std::string dirStr = loader.getObjectProperty(objectIndex, "direction");
+
+      Warp warp;
+      warp.srcX = object->x / map->m_tileWidth;
+      warp.srcY = object->y / map->m_tileHeight;
+      warp.dstX = fromString<int>(loader.getObjectProperty(objectIndex, "destX"));
+      warp.dstY = fromString<int>(loader.getObjectProperty(objectIndex, "destY"));
+      warp.destMap = loader.getObjectProperty(objectIndex, "destMap");
+      warp.dir = dirStr.empty() ? DIR_RANDOM : directionFromString(dirStr);
+      map->m_warps.push_back(warp);
+
+      TRACE("New warp: srcX=%d, srcY=%d, dstX=%d, dstY=%d, dstMap=%s, direction=%s",
+          warp.srcX, warp.srcY, warp.dstX, warp.dstY, warp.destMap.c_str(), dirStr.c_str());
+    }
+    else if (to_lower(name) == "trap")
+    {
+      int trapX = object->x / map->m_tileWidth;
+      int trapY = object->y / map->m_tileHeight;
+
+      std::string trapType = loader.getObjectType(objectIndex);
+      int trapDifficulty = fromString<int>(loader.getObjectProperty(objectIndex, "difficulty"));
+
+      map->m_traps.push_back( Trap { trapType, trapDifficulty, trapX, trapY } );
+
+      TRACE("New trap: trapX=%d, trapY=%d, trapType=%s, difficulty=%d",
+          trapX, trapY, trapType.c_str(), trapDifficulty);
+    }
+    else if (to_lower(name) == "light")
+    {
+      std::string radius = loader.getObjectProperty(objectIndex, "radius");
+      std::string intensity = loader.getObjectProperty(objectIndex, "intensity");
+
+      Light light;
+      light.x = static_cast<float>(object->x) / map->m_tileWidth;
+      light.y = static_cast<float>(object->y) / map->m_tileHeight;
+      light.radius = radius.empty() ? 4.0f : fromString<float>(radius);
+      light.intensity = intensity.empty() ? 1.0f : fromString<float>(intensity);
+      light.flicker = loader.getObjectProperty(objectIndex, "flicker") == "true";
+      map->m_lights.push_back(light);
+
+      TRACE("New light: x=%.2f, y=%.2f, radius=%.2f, intensity=%.2f, flicker=%d",
+          light.x, light.y, light.radius, light.intensity, light.flicker);
+    }
   }
-  else
+
+  TRACE("Reading encounters");
+  std::string encounters_str = loader.getProperty("encounters");
+  std::vector<std::string> encounters = split_string(encounters_str, ',');
+  map->m_encounters = encounters;
+
+  TRACE(" -> %s", encounters_str.c_str());
+
+  map->computeVisibility();
+
+  if (!loader.getProperty("ambientLight").empty())
   {
-    TRACE("Unable to open tiled file %s", filename.c_str());
+    map->m_ambientLight = fromString<float>(loader.getProperty("ambientLight"));
   }
 
+  map->bakeLights();
+
   return map;
 }
 
@@ -383,8 +640,11 @@ Map* Map::createEmptyFrom(const Map* other, int width, int height)
   Map* map = new Map;
   map->m_width = width;
   map->m_height = height;
+  map->m_tileWidth = other->m_tileWidth;
+  map->m_tileHeight = other->m_tileHeight;
   map->m_tileset = cache::loadTexture(other->m_tilesetName);
   map->m_tilesetName = other->m_tilesetName;
+  map->m_atlas = cache::loadTileset(other->m_tilesetName);
 
   if (!map->m_tileset)
   {
@@ -415,28 +675,65 @@ Map* Map::createEmptyFrom(const Map* other, int width, int height)
   addLayer("floor");
   addLayer("ceiling");
 
+  map->updateLayers();
+
   return map;
 }
 
+void Map::updateLayers()
+{
+  for (int i = 0; i < NUMBER_OF_LAYERS; i++)
+  {
+    auto it = m_tiles.find(layerToString(static_cast<MapLayer>(i)));
+    m_layers[i] = it != m_tiles.end() ? it->second : 0;
+  }
+}
+
 Tile* Map::getTileAt(int x, int y, const std::string& layer)
 {
+  MapLayer mapLayer = layerFromString(layer);
+  if (mapLayer != LAYER_NONE)
+  {
+    return getTileAt(x, y, mapLayer);
+  }
+
+  // Layer the engine doesn't know about.
   if (x < 0 || y < 0 || x >= m_width || y >= m_height || m_tiles.count(layer) == 0)
     return 0;
 
-  int index = y * m_width + x;
-  if (index >= 0 && index < getNumberOfTiles())
+  return &m_tiles[layer][y * m_width + x];
+}
+
+void Map::setTileAt(int x, int y, const std::string& layer, int tileId)
+{
+  MapLayer mapLayer = layerFromString(layer);
+  if (mapLayer != LAYER_NONE)
   {
-    return &m_tiles[layer][index];
+    setTileAt(x, y, mapLayer, tileId);
+  }
+  else
+  {
+    setTile(getTileAt(x, y, layer), tileId);
   }
-  return 0;
 }
 
-void Map::setTileAt(int x, int y, const std::string& layer, int tileId)
+void Map::setTileAt(int x, int y, MapLayer layer, int tileId)
 {
-  Tile* tile = getTileAt(x, y, layer);
+  setTile(getTileAt(x, y, layer), tileId);
+
+  if (layer == LAYER_WALL)
+  {
+    updateVisibility(x, y);
+    bakeLights();
+  }
+}
 
+void Map::setTile(Tile* tile, int tileId)
+{
   if (tile)
   {
+    m_revision++;
+
     tile->tileId = tileId;
     tile->tileX = tileId % (m_tileset->getSize().x / config::TILE_W);
     tile->tileY = tileId / (m_tileset->getSize().x / config::TILE_H);
@@ -445,52 +742,91 @@ void Map::setTileAt(int x, int y, const std::string& layer, int tileId)
 
 bool Map::warpAt(int x, int y) const
 {
-  for (auto it = m_warps.begin(); it != m_warps.end(); ++it)
-  {
-    if (it->srcX == x && it->srcY == y)
-    {
-      return true;
-    }
-  }
-  return false;
+  return getWarpAt(x, y) != 0;
 }
 
 const Warp* Map::getWarpAt(int x, int y) const
 {
-  for (auto it = m_warps.begin(); it != m_warps.end(); ++it)
-  {
-    if (it->srcX == x && it->srcY == y)
-    {
-      return &(*it);
-    }
-  }
-  return 0;
+  if (m_warpIndex.empty() || !inside(x, y))
+    return 0;
+
+  int index = m_warpIndex[y * m_width + x];
+
+  return index >= 0 ? &m_warps[index] : 0;
 }
 
 bool Map::trapAt(int x, int y) const
 {
-  for (auto it = m_traps.begin(); it != m_traps.end(); ++it)
+  const Trap* trap = getTrapAt(x, y);
+
+  return trap && !Persistent::instance().isSet(getTrapKey(trap));
+}
+
+const Trap* Map::getTrapAt(int x, int y) const
+{
+  if (m_trapIndex.empty() || !inside(x, y))
+    return 0;
+
+  int index = m_trapIndex[y * m_width + x];
+
+  return index >= 0 ? &m_traps[index] : 0;
+}
+
+const std::vector<Entity*>& Map::getEntitiesAt(int x, int y) const
+{
+  if (m_entityIndex.empty() || !inside(x, y))
+    return NO_ENTITIES;
+
+  return m_entityIndex[y * m_width + x];
+}
+
+Entity* Map::getEntityAt(int x, int y) const
+{
+  for (Entity* entity : getEntitiesAt(x, y))
   {
-    if (it->x == x && it->y == y && !Persistent::instance().isSet(getTrapKey(&(*it))))
+    if ((int)entity->x == x && (int)entity->y == y)
     {
-      return true;
+      return entity;
     }
   }
 
-  return false;
+  return 0;
 }
 
-const Trap* Map::getTrapAt(int x, int y) const
+void Map::addToIndex(Entity* entity)
 {
-  for (auto it = m_traps.begin(); it != m_traps.end(); ++it)
+  int x = entity->x;
+  int y = entity->y;
+
+  // An entity is indexed at the tile its position rounds down to and at
+  // the tile it is walking to, which covers every tile it collides on.
+  const int tiles[][2] =
   {
-    if (it->x == x && it->y == y)
+    { x, y },
+    { entity->getTargetX(), entity->getTargetY() }
+  };
+
+  for (const auto& tile : tiles)
+  {
+    if (m_entityIndex.empty() || !inside(tile[0], tile[1]))
+      continue;
+
+    std::vector<Entity*>& entities = m_entityIndex[tile[1] * m_width + tile[0]];
+
+    if (std::find(entities.begin(), entities.end(), entity) == entities.end())
     {
-      return &(*it);
+      entities.push_back(entity);
     }
   }
+}
 
-  return 0;
+void Map::removeFromIndex(Entity* entity, int x, int y)
+{
+  if (m_entityIndex.empty() || !inside(x, y))
+    return;
+
+  std::vector<Entity*>& entities = m_entityIndex[y * m_width + x];
+  entities.erase(std::remove(entities.begin(), entities.end(), entity), entities.end());
 }
 
 void Map::disableTrap(const Trap* trap)
@@ -502,12 +838,12 @@ void Map::disableTrap(const Trap* trap)
 
 bool Map::blocking(int x, int y)
 {
-  Tile* tile = getTileAt(x, y, "wall");
+  Tile* tile = getTileAt(x, y, LAYER_WALL);
 
   if (tile && tile->tileId > 0)
     return true;
 
-  tile = getTileAt(x, y, "floor");
+  tile = getTileAt(x, y, LAYER_FLOOR);
   if (tile && tile->solid)
     return true;
 
@@ -527,21 +863,27 @@ std::string Map::xmlDump() const
   }
   xml << " </entities>\n";
 
+  // Explored tiles are written as the lengths of alternating runs of
+  // unexplored and explored tiles, starting with unexplored ones.
   for (auto it = s_explored.begin(); it != s_explored.end(); ++it)
   {
-    xml << " <explored name=\"" << it->first << "\">\n";
-    size_t cnt = 0;
+    xml << " <explored name=\"" << it->first << "\" encoding=\"rle\">\n";
+
+    bool value = false;
+    size_t run = 0;
     for (bool explored : it->second)
     {
-      xml << explored;
-
-      if (cnt < it->second.size() - 1)
-        xml << ",";
-      else
-        xml << "\n";
+      if (explored != value)
+      {
+        xml << run << ",";
+        value = explored;
+        run = 0;
+      }
 
-      cnt++;
+      run++;
     }
+    xml << run << "\n";
+
     xml << " </explored>\n";
   }
 
@@ -550,6 +892,29 @@ std::string Map::xmlDump() const
   return xml.str();
 }
 
+size_t Map::getMemoryUsage() const
+{
+  size_t size = sizeof(Map);
+
+  size += m_tiles.size() * getNumberOfTiles() * sizeof(Tile);
+  size += m_entities.size() * ENTITY_SIZE_ESTIMATE;
+  size += m_visibility.size() * sizeof(sf::Uint32);
+  size += m_visibilitySeen.size() / 8 + m_visibilityTouched.capacity() * sizeof(int);
+
+  for (const Light& light : m_lights)
+  {
+    size += sizeof(Light) + light.litTiles.size() * sizeof(light.litTiles[0]);
+  }
+
+  size += (m_staticLight.size() + m_dynamicLight.size()) * sizeof(float);
+  size += m_lightMap.size() * sizeof(int);
+
+  size += (m_warpIndex.size() + m_trapIndex.size()) * sizeof(int);
+  size += m_entityIndex.size() * sizeof(std::vector<Entity*>) + m_entities.size() * 2 * sizeof(Entity*);
+
+  return size;
+}
+
 const Encounter* Map::checkEncounter()
 {
   std::string encounter;
@@ -574,48 +939,105 @@ bool Map::inside(int x, int y) const
   return x >= 0 && y >= 0 && x < getWidth() && y < getHeight();
 }
 
-std::vector<sf::Image> Map::getTilesetImages() const
+std::string Map::getTrapKey(const Trap* trap) const
 {
-  int w = m_tileset->getSize().x / config::TILE_W;
-  int h = m_tileset->getSize().y / config::TILE_H;
+  return "Trap[" + getName() + "," + toString(trap->x) + "," + toString(trap->y) + "]";
+}
 
-  sf::Image tempImage = m_tileset->copyToImage();
+std::string Map::getEntityStateKey(const Entity* entity) const
+{
+  // Not the tag itself, chests and doors already use that as key.
+  return "EntityState[" + entity->getTag() + "]";
+}
 
-  std::vector<sf::Image> images;
+void Map::saveEntityState() const
+{
+  for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
+  {
+    const Entity* entity = *it;
+
+    std::ostringstream state;
+    state << (int)entity->x << ","
+          << (int)entity->y << ","
+          << directionToString(entity->getDirection()) << ","
+          << entity->m_speed << ","
+          << entity->m_walkThrough;
+
+    Persistent::instance().set(getEntityStateKey(entity), state.str());
+  }
+}
+
+void Map::restoreEntityState()
+{
+  for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
+  {
+    Entity* entity = *it;
+    std::string key = getEntityStateKey(entity);
+
+    if (!Persistent::instance().isSet(key))
+      continue;
+
+    std::vector<std::string> state = split_string(Persistent::instance().get(key), ',');
+    if (state.size() != 5)
+      continue;
+
+    entity->setPosition(fromString<int>(state[0]), fromString<int>(state[1]));
+    entity->setDirection(directionFromString(state[2]));
+    entity->setWalkSpeed(fromString<float>(state[3]));
+    entity->setWalkThrough(fromString<bool>(state[4]));
+  }
+}
+
+void Map::buildIndex()
+{
+  m_warpIndex.assign(getNumberOfTiles(), -1);
+  m_trapIndex.assign(getNumberOfTiles(), -1);
+  m_entityIndex.assign(getNumberOfTiles(), std::vector<Entity*>());
 
-  for (int y = 0; y < h; y++)
+  // If there are several warps or traps on a tile, the first one wins.
+  for (size_t i = 0; i < m_warps.size(); i++)
   {
-    for (int x = 0; x < w; x++)
+    const Warp& warp = m_warps[i];
+
+    if (inside(warp.srcX, warp.srcY) && m_warpIndex[warp.srcY * m_width + warp.srcX] < 0)
     {
-      sf::Image image;
-      image.create(config::TILE_W, config::TILE_H, sf::Color::Transparent);
-      image.copy(tempImage, 0, 0, sf::IntRect(x * config::TILE_W, y * config::TILE_H, config::TILE_W, config::TILE_H), true);
-      images.push_back(image);
+      m_warpIndex[warp.srcY * m_width + warp.srcX] = i;
     }
   }
 
-  return images;
-}
+  for (size_t i = 0; i < m_traps.size(); i++)
+  {
+    const Trap& trap = m_traps[i];
 
-std::string Map::getTrapKey(const Trap* trap) const
-{
-  return "Trap[" + getName() + "," + toString(trap->x) + "," + toString(trap->y) + "]";
+    if (inside(trap.x, trap.y) && m_trapIndex[trap.y * m_width + trap.x] < 0)
+    {
+      m_trapIndex[trap.y * m_width + trap.x] = i;
+    }
+  }
+
+  for (Entity* entity : m_entities)
+  {
+    entity->m_map = this;
+    addToIndex(entity);
+  }
 }
 
 void Map::explore(int x, int y)
 {
-//  if (isExplored(x, y))
-//    return;
+  if (!m_explored)
+    return;
+
+  std::vector<bool>& explored = *m_explored;
 
   for (int py = y - 1; py <= y + 1; py++)
   {
     for (int px = x - 1; px <= x + 1; px++)
     {
-      int index = py * m_width + px;
+      size_t index = py * m_width + px;
 
-      if (index >= 0 && index < (m_width * m_height))
+      if (inside(px, py) && index < explored.size())
       {
-        s_explored[getName()][index] = true;
+        explored[index] = true;
       }
     }
   }
@@ -623,15 +1045,313 @@ void Map::explore(int x, int y)
 
 bool Map::isExplored(int x, int y) const
 {
-  int index = y * m_width + x;
-
-  if (index < 0 || index >= (m_width * m_height))
+  if (!m_explored || !inside(x, y))
     return false;
 
-  return s_explored[getName()][index];
+  // A loaded save may hold a different size for a map that has changed.
+  size_t index = y * m_width + x;
+
+  return index < m_explored->size() && (*m_explored)[index];
 }
 
 void Map::updateExplored(const std::string& mapName, const std::vector<bool>& explored)
 {
   s_explored[mapName] = explored;
 }
+
+void Map::computeVisibility()
+{
+  if (!m_layers[LAYER_WALL])
+  {
+    m_visibility.clear();
+    return;
+  }
+
+  m_visibilityClustersX = (m_width + VISIBILITY_CLUSTER - 1) / VISIBILITY_CLUSTER;
+  int clustersY = (m_height + VISIBILITY_CLUSTER - 1) / VISIBILITY_CLUSTER;
+  int numberOfClusters = m_visibilityClustersX * clustersY;
+
+  m_visibilityStride = (numberOfClusters + 31) / 32;
+  m_visibility.assign(numberOfClusters * m_visibilityStride, 0);
+  m_visibilitySeen.assign(getNumberOfTiles(), false);
+
+  for (int cluster = 0; cluster < numberOfClusters; cluster++)
+  {
+    computeVisibilityFrom(cluster);
+  }
+}
+
+void Map::computeVisibilityFrom(int cluster)
+{
+  const Tile* walls = m_layers[LAYER_WALL];
+
+  int minX = (cluster % m_visibilityClustersX) * VISIBILITY_CLUSTER;
+  int minY = (cluster / m_visibilityClustersX) * VISIBILITY_CLUSTER;
+  int maxX = std::min(m_width, minX + VISIBILITY_CLUSTER);
+  int maxY = std::min(m_height, minY + VISIBILITY_CLUSTER);
+
+  m_visibilityTouched.clear();
+
+  // The camera is never inside a wall, isPotentiallyVisible deals with
+  // that, so only floor tiles cast rays.
+  for (int y = minY; y < maxY; y++)
+  {
+    for (int x = minX; x < maxX; x++)
+    {
+      if (walls[y * m_width + x].tileId == -1)
+        castVisibilityRays(x, y);
+    }
+  }
+
+  sf::Uint32* row = &m_visibility[cluster * m_visibilityStride];
+  std::fill(row, row + m_visibilityStride, 0);
+
+  // Grow the set by a tile in every direction, to make up for the gaps
+  // between rays and for sprites standing between two tiles.
+  for (int tile : m_visibilityTouched)
+  {
+    int tx = tile % m_width;
+    int ty = tile / m_width;
+
+    for (int ny = std::max(0, ty - 1); ny <= std::min(m_height - 1, ty + 1); ny++)
+    {
+      for (int nx = std::max(0, tx - 1); nx <= std::min(m_width - 1, tx + 1); nx++)
+      {
+        int bit = getVisibilityCluster(nx, ny);
+        row[bit / 32] |= 1u << (bit % 32);
+      }
+    }
+
+    m_visibilitySeen[tile] = false;
+  }
+}
+
+void Map::castVisibilityRays(int x, int y)
+{
+  const Tile* walls = m_layers[LAYER_WALL];
+
+  for (const auto& sample : VISIBILITY_SAMPLES)
+  {
+    for (const auto& dir : VISIBILITY_DIRECTIONS)
+    {
+      // Step through the grid until the ray hits a wall, like the raycaster.
+      float posX = x + sample[0];
+      float posY = y + sample[1];
+
+      int mapX = x;
+      int mapY = y;
+
+      float ddx = dir.x != 0 ? fabs(1.0f / dir.x) : 1e30f;
+      float ddy = dir.y != 0 ? fabs(1.0f / dir.y) : 1e30f;
+
+      int stepX = dir.x < 0 ? -1 : 1;
+      int stepY = dir.y < 0 ? -1 : 1;
+
+      float sideDistX = (dir.x < 0 ? posX - mapX : mapX + 1.0f - posX) * ddx;
+      float sideDistY = (dir.y < 0 ? posY - mapY : mapY + 1.0f - posY) * ddy;
+
+      while (inside(mapX, mapY))
+      {
+        int tile = mapY * m_width + mapX;
+
+        if (!m_visibilitySeen[tile])
+        {
+          m_visibilitySeen[tile] = true;
+          m_visibilityTouched.push_back(tile);
+        }
+
+        if (walls[tile].tileId != -1)
+          break;
+
+        if (sideDistX < sideDistY)
+        {
+          sideDistX += ddx;
+          mapX += stepX;
+        }
+        else
+        {
+          sideDistY += ddy;
+          mapY += stepY;
+        }
+      }
+    }
+  }
+}
+
+void Map::updateVisibility(int x, int y)
+{
+  if (m_visibility.empty() || !inside(x, y))
+    return;
+
+  // A new wall can only hide things and the set is allowed to hold too
+  // much, so only an opened wall needs any work.
+  if (m_layers[LAYER_WALL][y * m_width + x].tileId != -1)
+    return;
+
+  const int changed = getVisibilityCluster(x, y);
+  const int numberOfClusters = m_visibility.size() / m_visibilityStride;
+
+  computeVisibilityFrom(changed);
+
+  // Whatever is seen through the opened tile can be seen from the tile
+  // itself, so every cluster that could see it gets its set added on.
+  const sf::Uint32* changedRow = &m_visibility[changed * m_visibilityStride];
+
+  for (int cluster = 0; cluster < numberOfClusters; cluster++)
+  {
+    sf::Uint32* row = &m_visibility[cluster * m_visibilityStride];
+
+    if (cluster == changed || !(row[changed / 32] & (1u << (changed % 32))))
+      continue;
+
+    for (int i = 0; i < m_visibilityStride; i++)
+    {
+      row[i] |= changedRow[i];
+    }
+  }
+}
+
+void Map::bakeLights()
+{
+  if (m_lights.empty() && m_ambientLight == 1.0f)
+  {
+    m_staticLight.clear();
+    m_dynamicLight.clear();
+    m_lightMap.clear();
+    return;
+  }
+
+  m_staticLight.assign(getNumberOfTiles(), m_ambientLight);
+
+  for (auto it = m_lights.begin(); it != m_lights.end(); ++it)
+  {
+    Light& light = *it;
+    light.litTiles.clear();
+
+    int minX = std::max(0, static_cast<int>(light.x - light.radius));
+    int maxX = std::min(m_width - 1, static_cast<int>(light.x + light.radius));
+    int minY = std::max(0, static_cast<int>(light.y - light.radius));
+    int maxY = std::min(m_height - 1, static_cast<int>(light.y + light.radius));
+
+    for (int y = minY; y <= maxY; y++)
+    {
+      for (int x = minX; x <= maxX; x++)
+      {
+        float dx = x + 0.5f - light.x;
+        float dy = y + 0.5f - light.y;
+        float falloff = 1.0f - sqrt(dx * dx + dy * dy) / light.radius;
+
+        if (falloff <= 0 || !lineOfSight(light.x, light.y, x, y))
+          continue;
+
+        float amount = light.intensity * falloff;
+
+        if (light.flicker)
+          light.litTiles.push_back(std::make_pair(y * m_width + x, amount));
+        else
+          m_staticLight[y * m_width + x] += amount;
+      }
+    }
+  }
+
+  m_dynamicLight.resize(getNumberOfTiles());
+  m_lightMap.resize(getNumberOfTiles());
+  for (int i = 0; i < getNumberOfTiles(); i++)
+  {
+    m_lightMap[i] = _light_to_fixed(m_staticLight[i]);
+  }
+
+  m_lightRevision++;
+
+  // Put the flickering lights back on top.
+  m_lightTicks = 0;
+  updateLights();
+}
+
+void Map::updateLights()
+{
+  bool flickering = false;
+  for (auto it = m_lights.begin(); it != m_lights.end(); ++it)
+  {
+    flickering = flickering || !it->litTiles.empty();
+  }
+
+  if (!flickering || (m_lightTicks++ % FLICKER_TICKS) != 0)
+    return;
+
+  // Start every tile a flickering light touches over from the steady
+  // light, add this tick's flicker and store the result.
+  for (auto it = m_lights.begin(); it != m_lights.end(); ++it)
+  {
+    for (auto tile = it->litTiles.begin(); tile != it->litTiles.end(); ++tile)
+    {
+      m_dynamicLight[tile->first] = m_staticLight[tile->first];
+    }
+  }
+
+  for (size_t i = 0; i < m_lights.size(); i++)
+  {
+    float flicker = _flicker(m_lightTicks, i);
+
+    for (auto tile = m_lights[i].litTiles.begin(); tile != m_lights[i].litTiles.end(); ++tile)
+    {
+      m_dynamicLight[tile->first] += tile->second * flicker;
+    }
+  }
+
+  for (auto it = m_lights.begin(); it != m_lights.end(); ++it)
+  {
+    for (auto tile = it->litTiles.begin(); tile != it->litTiles.end(); ++tile)
+    {
+      m_lightMap[tile->first] = _light_to_fixed(m_dynamicLight[tile->first]);
+    }
+  }
+
+  m_lightRevision++;
+}
+
+bool Map::lineOfSight(float fromX, float fromY, int x, int y) const
+{
+  const Tile* walls = m_layers[LAYER_WALL];
+  if (!walls)
+    return true;
+
+  float dirX = x + 0.5f - fromX;
+  float dirY = y + 0.5f - fromY;
+
+  int mapX = static_cast<int>(fromX);
+  int mapY = static_cast<int>(fromY);
+
+  float ddx = dirX != 0 ? fabs(1.0f / dirX) : 1e30f;
+  float ddy = dirY != 0 ? fabs(1.0f / dirY) : 1e30f;
+
+  int stepX = dirX < 0 ? -1 : 1;
+  int stepY = dirY < 0 ? -1 : 1;
+
+  float sideDistX = (dirX < 0 ? fromX - mapX : mapX + 1.0f - fromX) * ddx;
+  float sideDistY = (dirY < 0 ? fromY - mapY : mapY + 1.0f - fromY) * ddy;
+
+  // Walk the grid towards the target tile. The light may hang on a wall
+  // and the target may be one, anything in between may not.
+  while (mapX != x || mapY != y)
+  {
+    if (sideDistX < sideDistY)
+    {
+      sideDistX += ddx;
+      mapX += stepX;
+    }
+    else
+    {
+      sideDistY += ddy;
+      mapY += stepY;
+    }
+
+    if (!inside(mapX, mapY))
+      break;
+
+    if ((mapX != x || mapY != y) && walls[mapY * m_width + mapX].tileId != -1)
+      return false;
+  }
+
+  return true;
+}
@@ -16,6 +16,9 @@
 #include "Trap.h"
 
 class Encounter;
+class Tileset;
+class TiledLoader;
+struct PrefetchedMap;
 
 struct Tile
 {
@@ -24,6 +27,22 @@ struct Tile
   int tileId;
 };
 
+/// Layers the engine knows about. Used to index tiles without having to go
+/// through the layer name.
+enum MapLayer
+{
+  LAYER_WALL,
+  LAYER_FLOOR,
+  LAYER_CEILING,
+  LAYER_WALLFEATURE,
+
+  NUMBER_OF_LAYERS,
+  LAYER_NONE = NUMBER_OF_LAYERS
+};
+
+MapLayer layerFromString(const std::string& layerName);
+std::string layerToString(MapLayer layer);
+
 struct Warp
 {
   int srcX, srcY;
@@ -32,6 +51,19 @@ struct Warp
   Direction dir;
 };
 
+/// A point light placed in Tiled. Position and radius are in tiles.
+struct Light
+{
+  float x, y;
+  float radius;
+  float intensity;
+  bool flicker;
+
+  // Tiles the light reaches and how much it adds to them. Filled in when
+  // the light map is baked.
+  std::vector< std::pair<int, float> > litTiles;
+};
+
 static inline std::string getWarpTargetName(const Warp& warp)
 {
   return "Maps/" + warp.destMap;
@@ -45,12 +77,37 @@ public:
   int getWidth() const { return m_width; }
   int getHeight() const { return m_height; }
 
+  /// Tile size in pixels. config::TILE_W and TILE_H hold the values of the
+  /// map loaded last, which isn't necessarily this one.
+  int getTileWidth() const { return m_tileWidth; }
+  int getTileHeight() const { return m_tileHeight; }
+
   void update();
 
+  void setTileAt(int x, int y, MapLayer layer, int tileId);
   void setTileAt(int x, int y, const std::string& layer, int tileId);
+
+  Tile* getTileAt(int x, int y, MapLayer layer)
+  {
+    if (x < 0 || y < 0 || x >= m_width || y >= m_height || !m_layers[layer])
+      return 0;
+
+    return &m_layers[layer][y * m_width + x];
+  }
+
+  const Tile* getTileAt(int x, int y, MapLayer layer) const
+  {
+    return const_cast<Map*>(this)->getTileAt(x, y, layer);
+  }
+
   Tile* getTileAt(int x, int y, const std::string& layer);
+
+  /// Raw width * height tile array of a layer, or null if the map doesn't
+  /// have it.
+  const Tile* getLayerTiles(MapLayer layer) const { return m_layers[layer]; }
   bool warpAt(int x, int y) const;
   const Warp* getWarpAt(int x, int y) const;
+  const std::vector<Warp>& getWarps() const { return m_warps; }
 
   bool trapAt(int x, int y) const;
   const Trap* getTrapAt(int x, int y) const;
@@ -59,19 +116,77 @@ public:
   std::string getName() const { return m_name; }
   std::string getMusic() const { return m_music; }
 
-  static Map* loadTiledFile(const std::string& filename);
+  /// Load from prefetched if given, which must be filename prefetched by
+  /// MapPrefetcher, or else from the file. The map built by the prefetcher
+  /// is taken out of prefetched.
+  static Map* loadTiledFile(const std::string& filename, PrefetchedMap* prefetched = 0);
+
+  /// The part of loading a map that needs neither textures nor scripts:
+  /// properties, tile layers, warps, traps, lights, the visibility set and
+  /// the light bake. Safe to call from any thread. tilesetWidth is the
+  /// width in pixels of the image of the map's tileset. Null if the layers
+  /// don't all have width * height tiles of the same size.
+  static Map* loadGeometry(const std::string& filename, const TiledLoader& loader, int tilesetWidth);
   static Map* createEmptyFrom(const Map* other, int width, int height);
 
   const std::vector<Entity*>& getEntities() const { return m_entities; }
 
+  /// Entities standing on tile (x, y) or walking to it. Entities keep this
+  /// up to date themselves when they move.
+  const std::vector<Entity*>& getEntitiesAt(int x, int y) const;
+
+  /// An entity standing on tile (x, y), or null.
+  Entity* getEntityAt(int x, int y) const;
+
+  void addToIndex(Entity* entity);
+  void removeFromIndex(Entity* entity, int x, int y);
+
   bool blocking(int x, int y);
   bool inside(int x, int y) const;
 
   const Encounter* checkEncounter();
 
+  /// Bumped every time a tile is changed.
+  unsigned getRevision() const { return m_revision; }
+
+  /// False if walls block every line of sight from tile (fromX, fromY) to
+  /// tile (x, y). Conservative: may be true for tiles that can't be seen.
+  bool isPotentiallyVisible(int fromX, int fromY, int x, int y) const
+  {
+    if (m_visibility.empty() || !inside(fromX, fromY) || !inside(x, y))
+      return true;
+
+    // Inside a wall anything goes.
+    if (m_layers[LAYER_WALL][fromY * m_width + fromX].tileId != -1)
+      return true;
+
+    size_t bit = getVisibilityCluster(x, y);
+    const sf::Uint32* row = &m_visibility[getVisibilityCluster(fromX, fromY) * m_visibilityStride];
+
+    return row[bit / 32] & (1u << (bit % 32));
+  }
+
+  /// Light level of every tile, 8.8 fixed point where 256 is the normal
+  /// brightness. Null if the map has no lights.
+  const int* getLightMap() const { return m_lightMap.empty() ? 0 : &m_lightMap[0]; }
+
+  /// Bumped every time the light map changes.
+  unsigned getLightRevision() const { return m_lightRevision; }
+
   std::string xmlDump() const;
 
-  std::vector<sf::Image> getTilesetImages() const;
+  /// Store the position, direction and walking of every entity in
+  /// Persistent, like a save does for the current map. Done for maps
+  /// dropped from the map cache and for all cached maps when saving, the
+  /// next load of the map restores it.
+  void saveEntityState() const;
+
+  /// Rough number of bytes owned by the map. Textures are shared through
+  /// the cache and not counted.
+  size_t getMemoryUsage() const;
+
+  /// CPU side copy of the tileset, for reading tile texels.
+  const Tileset* getTileset() const { return m_atlas; }
   std::string getBattleBackground() const { return m_battleBackground; }
 
   const sf::Texture* getBackground() const { return m_background; }
@@ -91,25 +206,85 @@ private:
   }
 
   std::string getTrapKey(const Trap* trap) const;
+  std::string getEntityStateKey(const Entity* entity) const;
+
+  void restoreEntityState();
+
+  void buildIndex();
+
+  void updateLayers();
+  void setTile(Tile* tile, int tileId);
+
+  int getVisibilityCluster(int x, int y) const
+  {
+    return (y / VISIBILITY_CLUSTER) * m_visibilityClustersX + x / VISIBILITY_CLUSTER;
+  }
+
+  void computeVisibility();
+  void computeVisibilityFrom(int cluster);
+  void castVisibilityRays(int x, int y);
+  void updateVisibility(int x, int y);
+
+  void bakeLights();
+  void updateLights();
+  bool lineOfSight(float fromX, float fromY, int x, int y) const;
 private:
   std::map<std::string, Tile*> m_tiles;
+  // Points into m_tiles for the layers in MapLayer.
+  Tile* m_layers[NUMBER_OF_LAYERS];
   int m_width, m_height;
+  int m_tileWidth, m_tileHeight;
   std::vector<Entity*> m_entities;
   std::string m_music;
   std::vector<Warp> m_warps;
   std::vector<Trap> m_traps;
 
+  // Per tile index into m_warps and m_traps, -1 where there is none.
+  std::vector<int> m_warpIndex;
+  std::vector<int> m_trapIndex;
+  // Per tile list of the entities on or walking to the tile.
+  std::vector< std::vector<Entity*> > m_entityIndex;
+
   int m_encounterRate;
   std::vector< std::string > m_encounters;
 
   std::string m_tilesetName;
   sf::Texture* m_tileset;
+  Tileset* m_atlas;
   std::string m_name;
 
   std::string m_battleBackground;
   sf::Texture* m_background;
 
+  unsigned m_revision;
+
+  // Potentially visible set, kept for squares of VISIBILITY_CLUSTER tiles
+  // to stay small on big maps: one bit per cluster for every cluster, so
+  // m_visibilityStride words per cluster.
+  static const int VISIBILITY_CLUSTER = 4;
+  std::vector<sf::Uint32> m_visibility;
+  int m_visibilityStride;
+  int m_visibilityClustersX;
+  // Scratch space for computeVisibilityFrom: the tiles the rays reached,
+  // as a flag per tile and as a list so they can be cleared again cheaply.
+  std::vector<bool> m_visibilitySeen;
+  std::vector<int> m_visibilityTouched;
+
+  std::vector<Light> m_lights;
+  float m_ambientLight;
+  // Ambient plus all steady lights per tile.
+  std::vector<float> m_staticLight;
+  // Scratch space for adding the flickering lights on top.
+  std::vector<float> m_dynamicLight;
+  std::vector<int> m_lightMap;
+  unsigned m_lightRevision;
+  unsigned m_lightTicks;
+
+  // Explored tiles of every map visited, kept when the maps are unloaded.
+  // std::vector<bool> stores one bit per tile.
   static std::unordered_map<std::string, std::vector<bool>> s_explored;
+  // This map's entry in s_explored, looked up once at load.
+  std::vector<bool>* m_explored;
 };
 
 #endif
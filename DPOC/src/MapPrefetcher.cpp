@@ -0,0 +1,203 @@
+#include <algorithm>
+
+#include "Config.h"
+#include "logger.h"
+#include "Map.h"
+
+#include "MapPrefetcher.h"
+
+PrefetchedMap::PrefetchedMap()
+ : loaded(false),
+   map(0)
+{
+}
+
+PrefetchedMap::~PrefetchedMap()
+{
+  delete map;
+}
+
+MapPrefetcher::MapPrefetcher()
+ : m_quit(false)
+{
+  m_thread = std::thread(&MapPrefetcher::workerLoop, this);
+}
+
+MapPrefetcher::~MapPrefetcher()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+
+  m_condition.notify_all();
+  m_thread.join();
+
+  for (auto it = m_ready.begin(); it != m_ready.end(); ++it)
+  {
+    delete it->second;
+  }
+}
+
+void MapPrefetcher::prefetch(const std::vector<std::string>& maps)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  m_wanted = maps;
+  m_queue.clear();
+
+  for (auto it = m_ready.begin(); it != m_ready.end();)
+  {
+    if (isWanted(it->first))
+    {
+      ++it;
+    }
+    else
+    {
+      delete it->second;
+      m_ready.erase(it++);
+    }
+  }
+
+  for (auto it = maps.begin(); it != maps.end(); ++it)
+  {
+    if (m_ready.count(*it) == 0 && *it != m_loading)
+    {
+      m_queue.push_back(*it);
+    }
+  }
+
+  m_condition.notify_all();
+}
+
+PrefetchedMap* MapPrefetcher::take(const std::string& map)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  // Not started yet. Loading it right away beats waiting for the maps ahead
+  // of it in the queue.
+  m_queue.erase(std::remove(m_queue.begin(), m_queue.end(), map), m_queue.end());
+
+  while (m_loading == map)
+  {
+    m_condition.wait(lock);
+  }
+
+  auto it = m_ready.find(map);
+  if (it == m_ready.end())
+  {
+    return 0;
+  }
+
+  PrefetchedMap* prefetched = it->second;
+  m_ready.erase(it);
+
+  return prefetched;
+}
+
+void MapPrefetcher::workerLoop()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  while (true)
+  {
+    while (!m_quit && m_queue.empty())
+    {
+      m_condition.wait(lock);
+    }
+
+    if (m_quit)
+      break;
+
+    std::string map = m_queue.front();
+    m_queue.pop_front();
+    m_loading = map;
+
+    lock.unlock();
+    PrefetchedMap* prefetched = load(map);
+    lock.lock();
+
+    // The player may have moved on while it was loading.
+    if (isWanted(map))
+    {
+      m_ready[map] = prefetched;
+    }
+    else
+    {
+      delete prefetched;
+    }
+
+    m_loading.clear();
+    m_condition.notify_all();
+  }
+}
+
+bool MapPrefetcher::isWanted(const std::string& map) const
+{
+  return std::find(m_wanted.begin(), m_wanted.end(), map) != m_wanted.end();
+}
+
+PrefetchedMap* MapPrefetcher::load(const std::string& map)
+{
+  TRACE("Prefetching map %s", map.c_str());
+
+  PrefetchedMap* prefetched = new PrefetchedMap;
+  prefetched->loaded = prefetched->loader.load(config::res_path(map));
+
+  if (!prefetched->loaded)
+  {
+    return prefetched;
+  }
+
+  std::vector<std::string> images;
+  std::string mapTileset;
+
+  std::vector<std::string> tilesets = prefetched->loader.getTilesets();
+  for (auto it = tilesets.begin(); it != tilesets.end(); ++it)
+  {
+    const TiledLoader::Tileset* tileset = prefetched->loader.getTileset(*it);
+    images.push_back("Maps/" + tileset->tilesetSource);
+
+    if (tileset->startTileIndex == 1)
+    {
+      mapTileset = images.back();
+    }
+  }
+
+  std::string background = prefetched->loader.getProperty("background");
+  if (!background.empty())
+  {
+    images.push_back("Backgrounds/" + background);
+  }
+
+  for (auto it = images.begin(); it != images.end(); ++it)
+  {
+    sf::Image& image = prefetched->images[*it];
+
+    if (!image.loadFromFile(config::res_path(*it)))
+    {
+      // Left to the normal texture loading, which reports the error.
+      prefetched->images.erase(*it);
+    }
+  }
+
+  // The tile layers need the width of the tileset. Without it the map is
+  // built on the main thread, which reports the error.
+  int tilesetWidth = 0;
+
+  if (!mapTileset.empty())
+  {
+    auto it = prefetched->images.find(mapTileset);
+
+    if (it == prefetched->images.end())
+    {
+      return prefetched;
+    }
+
+    tilesetWidth = it->second.getSize().x;
+  }
+
+  prefetched->map = Map::loadGeometry(map, prefetched->loader, tilesetWidth);
+
+  return prefetched;
+}
@@ -0,0 +1,81 @@
+#ifndef MAP_PREFETCHER_H
+#define MAP_PREFETCHER_H
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <SFML/Graphics.hpp>
+
+#include "TiledLoader.h"
+
+class Map;
+
+/// A map file parsed ahead of time, with the images it uses decoded.
+struct PrefetchedMap
+{
+  PrefetchedMap();
+  ~PrefetchedMap();
+
+  bool loaded;
+  TiledLoader loader;
+
+  // Tilesets and background by texture name, like "Maps/Tileset.png".
+  std::map<std::string, sf::Image> images;
+
+  // What Map::loadGeometry builds, or null if the tileset couldn't be
+  // decoded. Taken by Map::loadTiledFile.
+  Map* map;
+private:
+  PrefetchedMap(const PrefetchedMap&);
+  PrefetchedMap& operator=(const PrefetchedMap&);
+};
+
+/**
+ * Loads the maps the player may go to next on a background thread. The map
+ * file is parsed, the images it uses are decoded and everything Map can
+ * build without textures or scripts is built: tile layers, visibility set
+ * and light bake. Creating the textures and the entities, which need the
+ * main thread, is left for when the map is entered.
+ */
+class MapPrefetcher
+{
+public:
+  MapPrefetcher();
+  ~MapPrefetcher();
+
+  /// Set the maps to have ready, by file name like "Maps/Town.tmx". Maps
+  /// prefetched earlier that aren't in the list are dropped.
+  void prefetch(const std::vector<std::string>& maps);
+
+  /// Take a prefetched map, waiting for it if it is being loaded right now.
+  /// Null if it isn't prefetched. The caller owns the result.
+  PrefetchedMap* take(const std::string& map);
+private:
+  MapPrefetcher(const MapPrefetcher&);
+  MapPrefetcher& operator=(const MapPrefetcher&);
+
+  void workerLoop();
+  bool isWanted(const std::string& map) const;
+
+  static PrefetchedMap* load(const std::string& map);
+private:
+  std::thread m_thread;
+  std::mutex m_mutex;
+
+  // Signalled when there is more to load and when a map has been loaded.
+  std::condition_variable m_condition;
+
+  std::vector<std::string> m_wanted;
+  std::deque<std::string> m_queue;
+  std::string m_loading;
+  std::map<std::string, PrefetchedMap*> m_ready;
+
+  bool m_quit;
+};
+
+#endif
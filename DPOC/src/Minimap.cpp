@@ -10,19 +10,6 @@ namespace
 {
   const int TILE_SIZE = 8;
 
-  Entity* _entity_at(const std::vector<Entity*>& entities, int x, int y)
-  {
-    for (auto it = entities.begin(); it != entities.end(); ++it)
-    {
-      if ((int)(*it)->x == x && (int)(*it)->y == y)
-      {
-        return *it;
-      }
-    }
-
-    return nullptr;
-  }
-
   const int TileId_WallMarker = 1;
   const int TileId_Floor      = 2;
   const int TileId_Obstacle   = 3;
@@ -72,8 +59,6 @@ void Minimap::draw(sf::RenderTarget& target) const
   int numberX = m_w / TILE_SIZE;
   int numberY = m_h / TILE_SIZE;
 
-  auto entities = m_currentMap->getEntities();
-
   // If even number, need to adjust the check below.
   int addX = ((numberX % 2) == 0) ? -1 : 0;
   int addY = ((numberY % 2) == 0) ? -1 : 0;
@@ -97,7 +82,7 @@ void Minimap::draw(sf::RenderTarget& target) const
         continue;
       }
 
-      Tile* tile = m_currentMap->getTileAt(x, y, "wall");
+      Tile* tile = m_currentMap->getTileAt(x, y, LAYER_WALL);
 
       if (tile && tile->tileId > -1)
       {
@@ -113,7 +98,7 @@ void Minimap::draw(sf::RenderTarget& target) const
         drawTile(target, TileId_Floor, tx, ty, sf::Color(0, 127, 255));
       }
 
-      if (Entity* entity = _entity_at(entities, x, y))
+      if (Entity* entity = m_currentMap->getEntityAt(x, y))
       {
         if (entity->getName() == "chest")
         {
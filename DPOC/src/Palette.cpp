@@ -0,0 +1,239 @@
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+
+#include "logger.h"
+#include "Shading.h"
+
+#include "Palette.h"
+
+namespace
+{
+  // Colors are counted and looked up with 5 bits per channel.
+  const int CHANNEL_BITS = 5;
+  const int CHANNEL_MAX = (1 << CHANNEL_BITS) - 1;
+  const int NUMBER_OF_KEYS = 1 << (3 * CHANNEL_BITS);
+
+  // Shading levels each texel is counted at when picking colors, so dark
+  // walls far away have colors to map to as well.
+  const int SHADE_SAMPLES = 8;
+
+  int _key(sf::Uint32 pixel)
+  {
+    return (pixel::red(pixel) >> 3) | ((pixel::green(pixel) >> 3) << 5) | ((pixel::blue(pixel) >> 3) << 10);
+  }
+
+  int _channel(int key, int channel)
+  {
+    return (key >> (channel * CHANNEL_BITS)) & CHANNEL_MAX;
+  }
+
+  // 5 bit channel value back to 8 bits.
+  int _expand(int value)
+  {
+    return (value << 3) | (value >> 2);
+  }
+
+  // Weighted roughly by how sensitive the eye is to each channel.
+  int _distance(sf::Uint32 color, int r, int g, int b)
+  {
+    int dr = pixel::red(color) - r;
+    int dg = pixel::green(color) - g;
+    int db = pixel::blue(color) - b;
+
+    return 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+  }
+
+  // Colors for median cut, with the channel they spread the most along.
+  struct ColorBox
+  {
+    std::vector<int> keys;
+    int channel;
+    int range;
+  };
+
+  void _measure(ColorBox& box)
+  {
+    box.channel = 0;
+    box.range = 0;
+
+    for (int channel = 0; channel < 3; channel++)
+    {
+      int lo = CHANNEL_MAX, hi = 0;
+
+      for (auto it = box.keys.begin(); it != box.keys.end(); ++it)
+      {
+        lo = std::min(lo, _channel(*it, channel));
+        hi = std::max(hi, _channel(*it, channel));
+      }
+
+      if (hi - lo > box.range)
+      {
+        box.channel = channel;
+        box.range = hi - lo;
+      }
+    }
+  }
+}
+
+// Passed by reference to std::fill and friends, so it needs a definition.
+const sf::Uint8 Palette::TRANSPARENT_INDEX;
+
+Palette::Palette()
+ : m_numberOfColors(1)
+{
+  std::fill(m_colors, m_colors + SIZE, pixel::Black);
+}
+
+void Palette::build(const sf::Uint32* pixels, size_t count, const Shading& shading)
+{
+  std::vector<int> histogram(NUMBER_OF_KEYS, 0);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (pixel::alpha(pixels[i]) != 255)
+      continue;
+
+    for (int sample = 0; sample < SHADE_SAMPLES; sample++)
+    {
+      int level = (shading.getLevels() - 1) * (SHADE_SAMPLES - sample) / SHADE_SAMPLES;
+
+      histogram[_key(shading.shade(pixels[i], level))]++;
+    }
+  }
+
+  std::vector<ColorBox> boxes(1);
+
+  for (int key = 0; key < NUMBER_OF_KEYS; key++)
+  {
+    if (histogram[key])
+      boxes[0].keys.push_back(key);
+  }
+
+  const int distinct = boxes[0].keys.size();
+
+  _measure(boxes[0]);
+
+  // Split the widest box at its median until the palette is full. Index 0
+  // is reserved.
+  while ((int)boxes.size() < SIZE - 1)
+  {
+    size_t widest = 0;
+
+    for (size_t i = 1; i < boxes.size(); i++)
+    {
+      if (boxes[i].range > boxes[widest].range)
+        widest = i;
+    }
+
+    ColorBox& box = boxes[widest];
+
+    if (box.range == 0)
+      break;
+
+    const int channel = box.channel;
+
+    std::sort(box.keys.begin(), box.keys.end(), [channel](int a, int b)
+    {
+      return _channel(a, channel) < _channel(b, channel);
+    });
+
+    int total = 0;
+    for (auto it = box.keys.begin(); it != box.keys.end(); ++it)
+    {
+      total += histogram[*it];
+    }
+
+    // Both halves get at least one color.
+    size_t split = 1;
+    for (int sum = histogram[box.keys[0]]; split < box.keys.size() - 1 && sum * 2 < total; split++)
+    {
+      sum += histogram[box.keys[split]];
+    }
+
+    ColorBox upper;
+    upper.keys.assign(box.keys.begin() + split, box.keys.end());
+    box.keys.resize(split);
+
+    _measure(box);
+    _measure(upper);
+
+    boxes.push_back(upper);
+  }
+
+  m_numberOfColors = 1;
+
+  for (auto box = boxes.begin(); box != boxes.end(); ++box)
+  {
+    if (box->keys.empty())
+      continue;
+
+    int64_t r = 0, g = 0, b = 0, weight = 0;
+
+    for (auto it = box->keys.begin(); it != box->keys.end(); ++it)
+    {
+      r += (int64_t)_expand(_channel(*it, 0)) * histogram[*it];
+      g += (int64_t)_expand(_channel(*it, 1)) * histogram[*it];
+      b += (int64_t)_expand(_channel(*it, 2)) * histogram[*it];
+      weight += histogram[*it];
+    }
+
+    m_colors[m_numberOfColors++] = pixel::pack(r / weight, g / weight, b / weight);
+  }
+
+  std::fill(m_colors + m_numberOfColors, m_colors + SIZE, pixel::Black);
+
+  m_lookup.resize(NUMBER_OF_KEYS);
+
+  for (int key = 0; key < NUMBER_OF_KEYS; key++)
+  {
+    m_lookup[key] = findNearest(_expand(_channel(key, 0)), _expand(_channel(key, 1)), _expand(_channel(key, 2)));
+  }
+
+  buildColormap(shading);
+
+  TRACE("Palette: %d colors for %d distinct", m_numberOfColors - 1, distinct);
+}
+
+void Palette::buildColormap(const Shading& shading)
+{
+  m_colormap.resize(shading.getLevels() * SIZE);
+
+  for (int level = 0; level < shading.getLevels(); level++)
+  {
+    sf::Uint8* colormap = &m_colormap[level * SIZE];
+
+    colormap[TRANSPARENT_INDEX] = TRANSPARENT_INDEX;
+
+    for (int i = 1; i < SIZE; i++)
+    {
+      sf::Uint32 shaded = shading.shade(m_colors[i], level);
+      sf::Uint8 index = m_lookup[_key(shaded)];
+
+      int r = pixel::red(shaded), g = pixel::green(shaded), b = pixel::blue(shaded);
+
+      // Index 0 is never a texel but it is black, which the darkest levels
+      // may be closest to.
+      colormap[i] = _distance(pixel::Black, r, g, b) < _distance(m_colors[index], r, g, b) ? TRANSPARENT_INDEX : index;
+    }
+  }
+}
+
+sf::Uint8 Palette::findNearest(int r, int g, int b) const
+{
+  sf::Uint8 nearest = TRANSPARENT_INDEX;
+  int nearestDist = 0;
+
+  for (int i = 1; i < m_numberOfColors; i++)
+  {
+    int dist = _distance(m_colors[i], r, g, b);
+
+    if (nearest == TRANSPARENT_INDEX || dist < nearestDist)
+    {
+      nearest = (sf::Uint8)i;
+      nearestDist = dist;
+    }
+  }
+
+  return nearest;
+}
@@ -0,0 +1,65 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <vector>
+
+#include <SFML/Graphics.hpp>
+
+#include "Pixel.h"
+
+class Shading;
+
+/**
+ * 256 color palette for the raycaster's indexed mode. Built from the tileset
+ * by median cut, with a colormap giving the palette index of every color at
+ * every shading level, so shading an indexed texel is one table lookup.
+ *
+ * Index 0 is black and stands for texels that are not fully opaque. No
+ * opaque texel maps to it.
+ */
+class Palette
+{
+public:
+  static const int SIZE = 256;
+  static const sf::Uint8 TRANSPARENT_INDEX = 0;
+
+  Palette();
+
+  /// Pick the colors that best cover the opaque texels in pixels, as they
+  /// look at a spread of shading levels, and build the colormap.
+  void build(const sf::Uint32* pixels, size_t count, const Shading& shading);
+
+  /// Nearest palette index, or TRANSPARENT_INDEX for pixels that aren't opaque.
+  sf::Uint8 map(sf::Uint32 pixel) const
+  {
+    if (pixel::alpha(pixel) != 255)
+      return TRANSPARENT_INDEX;
+
+    return m_lookup[(pixel::red(pixel) >> 3) | ((pixel::green(pixel) >> 3) << 5) | ((pixel::blue(pixel) >> 3) << 10)];
+  }
+
+  /// SIZE entries mapping an index to its shaded index at level.
+  const sf::Uint8* getColormap(int level) const { return &m_colormap[level * SIZE]; }
+
+  /// Convert count indices to RGBA.
+  void expand(const sf::Uint8* indices, sf::Uint32* pixels, size_t count) const
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      pixels[i] = m_colors[indices[i]];
+    }
+  }
+private:
+  void buildColormap(const Shading& shading);
+  sf::Uint8 findNearest(int r, int g, int b) const;
+private:
+  sf::Uint32 m_colors[SIZE];
+  int m_numberOfColors;
+
+  // Nearest palette index for every color with 5 bits per channel.
+  std::vector<sf::Uint8> m_lookup;
+
+  std::vector<sf::Uint8> m_colormap;
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <SFML/Graphics.hpp>
+
+/**
+ * Packed 32 bit pixels used by the raycaster. Channels are stored so that the
+ * bytes in memory come out as R, G, B, A on little endian machines, which is
+ * the same layout as sf::Image::getPixelsPtr() and what sf::Texture::update
+ * expects.
+ */
+namespace pixel
+{
+  inline sf::Uint32 pack(sf::Uint8 r, sf::Uint8 g, sf::Uint8 b, sf::Uint8 a = 255)
+  {
+    return (sf::Uint32)r | ((sf::Uint32)g << 8) | ((sf::Uint32)b << 16) | ((sf::Uint32)a << 24);
+  }
+
+  inline sf::Uint8 red(sf::Uint32 p)   { return p & 0xff; }
+  inline sf::Uint8 green(sf::Uint32 p) { return (p >> 8) & 0xff; }
+  inline sf::Uint8 blue(sf::Uint32 p)  { return (p >> 16) & 0xff; }
+  inline sf::Uint8 alpha(sf::Uint32 p) { return (p >> 24) & 0xff; }
+
+  inline sf::Uint32 fromColor(const sf::Color& color)
+  {
+    return pack(color.r, color.g, color.b, color.a);
+  }
+
+  /// Read a pixel from an RGBA byte array such as sf::Image::getPixelsPtr().
+  inline sf::Uint32 fromBytes(const sf::Uint8* bytes)
+  {
+    return pack(bytes[0], bytes[1], bytes[2], bytes[3]);
+  }
+
+  const sf::Uint32 Black = 0xff000000;
+}
+
+#endif
@@ -3,175 +3,689 @@
 
 #include <vector>
 #include <algorithm>
+#include <chrono>
 
 #include <SFML/Graphics.hpp>
 
 #include "Config.h"
+#include "Utility.h"
+#include "WorkerPool.h"
 
 #include "Vec2.h"
 #include "Map.h"
 #include "Entity.h"
 #include "Sprite.h"
 #include "Door.h"
+#include "Pixel.h"
+#include "Shading.h"
+#include "Palette.h"
+#include "Tileset.h"
 
 #include "Raycaster.h"
 
-float zbuffer[320];
-
 namespace
 {
   const float INTENSITY = 0.75f;
   const float MULTIPLIER = 2.0f;
-}
 
-sf::Color computeIntensity(const sf::Color& pixel, float objectIntensity, float multiplier, float distance) 
-{
-    float intensity = objectIntensity / distance * multiplier;
+  const float FLOOR_INTENSITY = 0.75f;
+  const float FLOOR_MULTIPLIER = 1.0f;
+
+  // Keeps lit floor shading scales from overflowing.
+  const float MAX_ROW_INTENSITY = 16.0f;
+
+  // Columns or rows handed to a worker at a time.
+  const int COLUMN_CHUNK_SIZE = 8;
+  const int ROW_CHUNK_SIZE = 4;
+
+  const int DEFAULT_SHADING_LEVELS = 128;
+  const int DEFAULT_SHADING_TOLERANCE = 2;
+
+  // Memory for pre-shaded wall tiles, in MB.
+  const int DEFAULT_PRESHADE_BUDGET = 16;
+
+  // Halve a tile in both directions, averaging each 2x2 block. Colors are
+  // weighted by alpha so transparent pixels don't bleed into the result.
+  void _downsample(const sf::Uint32* src, int srcWidth, int srcHeight, sf::Uint32* dst, int dstWidth, int dstHeight)
+  {
+    for (int y = 0; y < dstHeight; y++)
+    {
+      for (int x = 0; x < dstWidth; x++)
+      {
+        int r = 0, g = 0, b = 0, a = 0;
+
+        for (int i = 0; i < 4; i++)
+        {
+          int sx = std::min(x * 2 + (i & 1), srcWidth - 1);
+          int sy = std::min(y * 2 + (i >> 1), srcHeight - 1);
+
+          sf::Uint32 texel = src[sy * srcWidth + sx];
+          int alpha = pixel::alpha(texel);
+
+          r += pixel::red(texel) * alpha;
+          g += pixel::green(texel) * alpha;
+          b += pixel::blue(texel) * alpha;
+          a += alpha;
+        }
 
-    sf::Uint8 orig_r = pixel.r;
-    sf::Uint8 orig_g = pixel.g;
-    sf::Uint8 orig_b = pixel.b;
+        dst[y * dstWidth + x] = a ? pixel::pack(r / a, g / a, b / a, a / 4) : 0;
+      }
+    }
+  }
 
-    float fr = (float) pixel.r;
-    float fg = (float) pixel.g;
-    float fb = (float) pixel.b;
+  // 16.16 fixed point. Distances are clamped so that adding one more step
+  // can't overflow.
+  const int FIXED_SHIFT = 16;
+  const float FIXED_MAX = (float)(1 << 14);
 
-    fr *= intensity;
-    fg *= intensity;
-    fb *= intensity;
+  sf::Uint32 _to_fixed(float value)
+  {
+    return (sf::Uint32)(std::min(value, FIXED_MAX) * (1 << FIXED_SHIFT));
+  }
 
-    if (fr > orig_r) fr = orig_r;
-    if (fg > orig_g) fg = orig_g;
-    if (fb > orig_b) fb = orig_b;
+  typedef std::chrono::steady_clock ProfileClock;
 
-    return sf::Color((sf::Uint8) fr, (sf::Uint8) fg, (sf::Uint8) fb);
+  // Add the time since start to counter and restart.
+  void _lap(bool enabled, ProfileClock::time_point& start, int64_t& counter)
+  {
+    if (enabled)
+    {
+      ProfileClock::time_point now = ProfileClock::now();
+      counter += std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+      start = now;
+    }
+  }
 }
 
 Raycaster::Raycaster(int width, int height)
  : m_width(width),
    m_height(height),
    m_camera(0),
-   m_tilemap(0)
+   m_tilemap(0),
+   m_lightMap(0),
+   m_lightMapWidth(0),
+   m_chainSize(0),
+   m_mipmaps(config::get("RAYCASTER_MIPMAPS") != "false"),
+   m_preshadeBudget((size_t)std::max(0, config::getInt("RAYCASTER_PRESHADE_MB", DEFAULT_PRESHADE_BUDGET)) * 1024 * 1024),
+   m_indexed(config::get("RAYCASTER_INDEXED") == "true"),
+   m_workerPool(0),
+   m_shading(config::getInt("SHADING_LEVELS", DEFAULT_SHADING_LEVELS),
+             config::getInt("SHADING_TOLERANCE", DEFAULT_SHADING_TOLERANCE)),
+   m_floorMode(config::get("RAYCASTER_FLOOR_MODE") == "scanlines" ? FLOOR_SCANLINES : FLOOR_COLUMNS),
+   m_fixedPoint(config::get("RAYCASTER_FIXED_POINT") == "true"),
+   m_profiling(false),
+   m_stats(),
+   m_nextRayTable(0),
+   m_columnRays(0)
+{
+  resize(width, height);
+
+  int threads = WorkerPool::resolveThreadCount(config::getInt("RAYCASTER_THREADS", 1));
+
+  if (threads > 1)
+  {
+    m_workerPool = new WorkerPool(threads);
+  }
+}
+
+Raycaster::~Raycaster()
 {
+  delete m_workerPool;
+}
+
+void Raycaster::resize(int width, int height)
+{
+  m_width = width;
+  m_height = height;
+
+  m_framebuffer.assign(width * height, pixel::Black);
+  m_indexedFramebuffer.assign(m_indexed ? width * height : 0, Palette::TRANSPARENT_INDEX);
+  m_zbuffer.assign(width, 0);
+
+  m_floorLevels.assign(height, 0);
+  m_ceilingLevels.assign(height, 0);
+  m_floorScales.assign(height, 0);
+  m_ceilingScales.assign(height, 0);
+
+  const int maxLevel = m_shading.getLevels() - 1;
+
+  // Floor and ceiling distance only depends on the screen row.
+  for (int y = height / 2 + 1; y < height; y++)
+  {
+    float rowDist = (float)height / (2.0f * y - height);
+
+    m_floorLevels[y] = m_shading.getLevel(FLOOR_INTENSITY * FLOOR_MULTIPLIER, rowDist);
+    m_ceilingLevels[y] = m_shading.getLevel(INTENSITY * MULTIPLIER, rowDist);
+
+    m_floorScales[y] = (int)(std::min(FLOOR_INTENSITY * FLOOR_MULTIPLIER / rowDist, MAX_ROW_INTENSITY) * maxLevel * 256);
+    m_ceilingScales[y] = (int)(std::min(INTENSITY * MULTIPLIER / rowDist, MAX_ROW_INTENSITY) * maxLevel * 256);
+  }
+
+  updateRowMips();
+  invalidateRayTables();
+}
+
+void Raycaster::invalidateRayTables()
+{
+  for (int i = 0; i < NUMBER_OF_RAY_TABLES; i++)
+  {
+    m_rayTables[i].columns.clear();
+  }
+
+  m_columnRays = 0;
+}
+
+int Raycaster::getMipLevel(int lineHeight) const
+{
+  int mip = 0;
+
+  // One level down for every halving of the on screen size.
+  while (mip + 1 < (int)m_mips.size() && (lineHeight << (mip + 1)) <= config::TILE_H)
+  {
+    mip++;
+  }
+
+  return mip;
+}
+
+void Raycaster::updateRowMips()
+{
+  m_rowMips.assign(m_height, 0);
+
+  // A wall at the distance of row y is 2y - height pixels tall.
+  for (int y = m_height / 2 + 1; y < m_height; y++)
+  {
+    m_rowMips[y] = getMipLevel(2 * y - m_height);
+  }
 }
 
 void Raycaster::setTilemap(Map* tilemap)
 {
   m_tilemap = tilemap;
-  m_tileTextures = tilemap->getTilesetImages();
+
+  // The entities belong to the previous map, which may be deleted already.
+  m_sprites.clear();
+  m_doors.clear();
+
+  const Tileset* tileset = tilemap->getTileset();
+  const int numberOfTiles = tileset ? tileset->getNumberOfTiles() : 0;
+
+  m_mips.clear();
+  m_chainSize = 0;
+
+  int mipWidth = config::TILE_W;
+  int mipHeight = config::TILE_H;
+
+  while (true)
+  {
+    MipLevel level = { mipWidth, mipHeight, m_chainSize };
+
+    m_mips.push_back(level);
+    m_chainSize += mipWidth * mipHeight;
+
+    if (!m_mipmaps || (mipWidth == 1 && mipHeight == 1))
+      break;
+
+    mipWidth = std::max(1, mipWidth / 2);
+    mipHeight = std::max(1, mipHeight / 2);
+  }
+
+  m_tileTexels.resize(numberOfTiles * m_chainSize);
+  m_wallTexels.resize(numberOfTiles * m_chainSize);
+
+  for (int i = 0; i < numberOfTiles; i++)
+  {
+    const sf::Uint8* bytes = tileset->getTilePixels(i);
+
+    sf::Uint32* texels = &m_tileTexels[i * m_chainSize];
+    sf::Uint32* columns = &m_wallTexels[i * m_chainSize];
+
+    // Tiles are read straight out of the tileset image.
+    for (int y = 0; y < config::TILE_H; y++)
+    {
+      const sf::Uint8* row = bytes + y * tileset->getPitch();
+
+      for (int x = 0; x < config::TILE_W; x++)
+      {
+        texels[y * config::TILE_W + x] = pixel::fromBytes(row + x * 4);
+      }
+    }
+
+    for (size_t mip = 1; mip < m_mips.size(); mip++)
+    {
+      const MipLevel& src = m_mips[mip - 1];
+      const MipLevel& dst = m_mips[mip];
+
+      _downsample(texels + src.offset, src.width, src.height, texels + dst.offset, dst.width, dst.height);
+    }
+
+    for (size_t mip = 0; mip < m_mips.size(); mip++)
+    {
+      const MipLevel& level = m_mips[mip];
+
+      for (int y = 0; y < level.height; y++)
+      {
+        for (int x = 0; x < level.width; x++)
+        {
+          columns[level.offset + x * level.height + y] = texels[level.offset + y * level.width + x];
+        }
+      }
+    }
+  }
+
+  if (m_indexed && !m_tileTexels.empty())
+  {
+    m_palette.build(&m_tileTexels[0], m_tileTexels.size(), m_shading);
+
+    m_tileIndices.resize(m_tileTexels.size());
+    m_wallIndices.resize(m_wallTexels.size());
+
+    for (size_t i = 0; i < m_tileTexels.size(); i++)
+    {
+      m_tileIndices[i] = m_palette.map(m_tileTexels[i]);
+      m_wallIndices[i] = m_palette.map(m_wallTexels[i]);
+    }
+
+    // Only the indices are used from here on.
+    std::vector<sf::Uint32>().swap(m_tileTexels);
+    std::vector<sf::Uint32>().swap(m_wallTexels);
+  }
+
+  updateRowMips();
+
+  // Pre-shade the tiles walls are actually built from.
+  m_shadedTexels.clear();
+  m_shadedSlots.assign(numberOfTiles, -1);
+
+  const int numberOfMapTiles = tilemap->getWidth() * tilemap->getHeight();
+  const Tile* walls = tilemap->getLayerTiles(LAYER_WALL);
+  const Tile* features = tilemap->getLayerTiles(LAYER_WALLFEATURE);
+
+  for (int i = 0; i < numberOfMapTiles; i++)
+  {
+    if (walls && walls[i].tileId > -1)
+      preshadeTile(walls[i].tileId);
+    if (features && features[i].tileId > -1)
+      preshadeTile(features[i].tileId);
+  }
+
+  // Door tiles are preshaded by addDoor.
+
+  // Filled by addDoor.
+  m_doorGrid.assign(m_tilemap->getWidth() * m_tilemap->getHeight(), 0);
 }
 
 void Raycaster::addEntity(const Entity* entity)
 {
-  m_entities.push_back(entity);
+  SpriteInfo info;
+  info.entity = entity;
+  info.distance = 0;
+  info.depth = 0;
+  info.screenX = info.size = 0;
+  info.startX = info.endX = 0;
+  info.culled = true;
+
+  m_sprites.push_back(info);
 }
 
 void Raycaster::removeEntity(const Entity* entity)
 {
-  m_entities.remove(entity);
+  for (size_t i = 0; i < m_sprites.size(); i++)
+  {
+    if (m_sprites[i].entity == entity)
+    {
+      // Order is restored by the next sort.
+      m_sprites[i] = m_sprites.back();
+      m_sprites.pop_back();
+      break;
+    }
+  }
 }
 
 void Raycaster::addDoor(const Door* door)
 {
   m_doors.push_back(door);
+
+  if (m_tilemap && !outOfBounds((int)door->x, (int)door->y))
+  {
+    m_doorGrid[(int)door->y * m_tilemap->getWidth() + (int)door->x] = door;
+  }
+
+  if (m_tilemap)
+  {
+    preshadeTile(static_cast<TileSprite*>(door->sprite())->getTileNum());
+  }
 }
 
-void Raycaster::raycast(Camera* camera, sf::Image& buffer, Direction pDir)
+void Raycaster::preshadeTile(int tileId)
+{
+  // The colormap already makes shading a lookup in indexed mode.
+  if (m_indexed || tileId < 0 || tileId >= (int)m_shadedSlots.size() || isPreshaded(tileId))
+  {
+    return;
+  }
+
+  const size_t tileSize = m_chainSize;
+  const size_t size = tileSize * m_shading.getLevels();
+
+  if ((m_shadedTexels.size() + size) * sizeof(sf::Uint32) > m_preshadeBudget)
+  {
+    return;
+  }
+
+  m_shadedSlots[tileId] = m_shadedTexels.size() / size;
+
+  const sf::Uint32* columns = &m_wallTexels[tileId * tileSize];
+
+  for (int level = 0; level < m_shading.getLevels(); level++)
+  {
+    for (size_t i = 0; i < tileSize; i++)
+    {
+      // Alpha is kept since wall features are drawn where they are opaque.
+      sf::Uint32 shaded = m_shading.shade(columns[i], level);
+
+      m_shadedTexels.push_back((shaded & ~pixel::Black) | (columns[i] & pixel::Black));
+    }
+  }
+}
+
+void Raycaster::clearEntities()
+{
+  m_sprites.clear();
+  m_doors.clear();
+
+  std::fill(m_doorGrid.begin(), m_doorGrid.end(), (const Door*)0);
+}
+
+void Raycaster::raycast(Camera* camera, Direction pDir)
 {
   m_camera = camera;
+  m_columnRays = findRayTable();
+  m_lightMap = m_tilemap->getLightMap();
+  m_lightMapWidth = m_tilemap->getWidth();
 
-  for (int x = 0; x < m_width; x++)
+  if (m_indexed)
+    std::fill(m_indexedFramebuffer.begin(), m_indexedFramebuffer.end(), Palette::TRANSPARENT_INDEX);
+  else
+    std::fill(m_framebuffer.begin(), m_framebuffer.end(), pixel::Black);
+
+  Stats emptyStats = {};
+  m_stats = emptyStats;
+
+  ProfileClock::time_point start;
+  if (m_profiling) start = ProfileClock::now();
+
+  if (m_floorMode == FLOOR_SCANLINES)
+  {
+    // Rows below the horizon. Ceiling rows are mirrored from these.
+    const int firstRow = m_height / 2 + 1;
+
+    runJob(m_height - firstRow, ROW_CHUNK_SIZE, [this, firstRow](int start, int end)
+    {
+      drawFloorCeilingRows(firstRow + start, firstRow + end);
+    });
+
+    _lap(m_profiling, start, m_stats.floors);
+  }
+
+  // Columns don't share any state so they can be cast in parallel. Sprites
+  // need the complete zbuffer and are drawn afterwards.
+  runJob(m_width, COLUMN_CHUNK_SIZE, [this](int startX, int endX)
+  {
+    drawColumns(startX, endX);
+  });
+
+  if (m_indexed)
+  {
+    runJob(m_height, ROW_CHUNK_SIZE, [this](int startY, int endY)
+    {
+      m_palette.expand(&m_indexedFramebuffer[startY * m_width], &m_framebuffer[startY * m_width], (endY - startY) * m_width);
+    });
+  }
+
+  if (m_profiling) start = ProfileClock::now();
+
+  drawSprites(pDir);
+
+  _lap(m_profiling, start, m_stats.sprites);
+}
+
+void Raycaster::runJob(int count, int chunkSize, const std::function<void(int, int)>& job)
+{
+  if (m_workerPool && !m_profiling)
+  {
+    m_workerPool->parallelFor(count, chunkSize, job);
+  }
+  else
+  {
+    job(0, count);
+  }
+}
+
+void Raycaster::drawColumns(int startX, int endX)
+{
+  // Wall slices are textured into here and shaded in one go.
+  std::vector<sf::Uint32> slice(m_height);
+
+  ProfileClock::time_point start;
+  if (m_profiling) start = ProfileClock::now();
+
+  for (int x = startX; x < endX; x++)
   {
     int lineHeight;
     int wallStart, wallEnd;
     
-    RayInfo info = castRay(x, m_width);
+    RayInfo doorInfo;
+    RayInfo info = castRay(x, m_width, doorInfo);
 
-    zbuffer[x] = info.wallDist;
+    m_zbuffer[x] = info.wallDist;
 
     lineHeight = (int)fabs((float)m_height / info.wallDist);
     wallStart = -lineHeight / 2 + m_height / 2;
     wallEnd = lineHeight / 2 + m_height / 2;
     
-    Tile* tile = m_tilemap->getTileAt(info.mapX, info.mapY, "wall");
-    drawWallSlice(info, buffer, x, lineHeight, wallStart, wallEnd, tile ? tile->tileId : -1);
+    const Tile* tile = m_tilemap->getTileAt(info.mapX, info.mapY, LAYER_WALL);
+    drawWallSlice(info, x, lineHeight, wallStart, wallEnd, tile ? tile->tileId : -1, &slice[0]);
+
+    _lap(m_profiling, start, m_stats.walls);
 
     if (wallEnd < 0)
     {
       wallEnd = m_height;
     }
 
-    drawFloorsCeiling(info, x, wallEnd, buffer);
+    if (m_floorMode == FLOOR_COLUMNS)
+    {
+      drawFloorsCeiling(info, x, wallEnd);
+
+      _lap(m_profiling, start, m_stats.floors);
+    }
 
-    if (m_doors.size())
+    if (doorInfo.door && doorInfo.wallDist < m_zbuffer[x])
     {
-      RayInfo doorInfo = castDoorRay(x, m_width);
-      if (doorInfo.side != -1 && doorInfo.wallDist < zbuffer[x])
-      {
-        zbuffer[x] = doorInfo.wallDist;
+      m_zbuffer[x] = doorInfo.wallDist;
 
-        int doorLineHeight = (int)fabs((float)m_height / doorInfo.wallDist);
-        int doorStart = -doorLineHeight / 2 + m_height / 2;
-        int doorEnd = doorLineHeight / 2 + m_height / 2;
+      int doorLineHeight = (int)fabs((float)m_height / doorInfo.wallDist);
+      int doorStart = -doorLineHeight / 2 + m_height / 2;
+      int doorEnd = doorLineHeight / 2 + m_height / 2;
 
-        int tileId = static_cast<TileSprite*>(doorInfo.door->sprite())->getTileNum();
-        drawWallSlice(doorInfo, buffer, x, doorLineHeight, doorStart, doorEnd, tileId);
-      }
+      int tileId = static_cast<TileSprite*>(doorInfo.door->sprite())->getTileNum();
+      drawWallSlice(doorInfo, x, doorLineHeight, doorStart, doorEnd, tileId, &slice[0]);
+
+      _lap(m_profiling, start, m_stats.doors);
     }
   }
-
-  drawSprites(buffer, pDir);
 }
 
-void Raycaster::drawWallSlice(const RayInfo& info, sf::Image& buffer, int x, int lineHeight, int wallStart, int wallEnd, int tileId)
+void Raycaster::drawWallSlice(const RayInfo& info, int x, int lineHeight, int wallStart, int wallEnd, int tileId, sf::Uint32* slice)
 {
-  Tile* featureTile = tileId > -1 ? m_tilemap->getTileAt(info.mapX, info.mapY, "wallfeature") : nullptr;
+  if (m_indexed)
+  {
+    drawWallSliceIndexed(info, x, lineHeight, wallStart, wallEnd, tileId);
+    return;
+  }
+
+  const Tile* featureTile = tileId > -1 ? m_tilemap->getTileAt(info.mapX, info.mapY, LAYER_WALLFEATURE) : nullptr;
 
   if (wallStart < 0)
   {
     wallStart = 0;
   }
 
-  for (int y = wallStart; y < std::min(wallEnd, m_height); y++)
+  wallEnd = std::min(wallEnd, m_height);
+
+  sf::Uint32* dest = &m_framebuffer[x];
+
+  if (tileId < 0)
   {
-    if (tileId > -1)
+    for (int y = wallStart; y < wallEnd; y++)
     {
-      int d, textureY;
+      dest[y * m_width] = pixel::Black;
+    }
 
-      d = y * 256 - m_height * 128 + lineHeight * 128;
-      textureY = ((d * config::TILE_W) / lineHeight) / 256;
+    return;
+  }
+
+  const int level = m_shading.getLevel(INTENSITY * MULTIPLIER * info.light / 256.0f, info.wallDist);
+  const int featureId = featureTile ? featureTile->tileId : -1;
+
+  // Read straight from the pre-shaded copy when there is one.
+  const bool preshaded = isPreshaded(tileId) && (featureId < 0 || isPreshaded(featureId));
+
+  const int mip = getMipLevel(lineHeight);
+  const int mipHeight = m_mips[mip].height;
 
-      sf::Color color = computeIntensity(
-          m_tileTextures[tileId].getPixel(info.textureX, textureY),
-          INTENSITY, MULTIPLIER, info.wallDist);
+  const sf::Uint32* texels = preshaded ? getShadedColumn(tileId, level, mip, info.textureX) : getWallColumn(tileId, mip, info.textureX);
+  const sf::Uint32* featureTexels = 0;
+
+  if (featureId > -1)
+  {
+    featureTexels = preshaded ? getShadedColumn(featureId, level, mip, info.textureX) : getWallColumn(featureId, mip, info.textureX);
+  }
+
+  int count = 0;
+
+  if (m_fixedPoint && lineHeight > 0)
+  {
+    // Step down the texture in 16.16 fixed point instead of dividing for
+    // every pixel. The start is the same texel the divide would give.
+    sf::Uint32 step = ((sf::Uint32)config::TILE_H << FIXED_SHIFT) / lineHeight;
+    sf::Uint32 position = (sf::Uint32)(((int64_t)std::max(0, 2 * wallStart - m_height + lineHeight) * config::TILE_H << FIXED_SHIFT) / (2 * lineHeight));
+
+    for (int y = wallStart; y < wallEnd; y++, position += step)
+    {
+      int textureY = std::min((int)(position >> (FIXED_SHIFT + mip)), mipHeight - 1);
 
-      buffer.setPixel(x, y, color);
+      sf::Uint32 color = texels[textureY];
 
-      if (featureTile && featureTile->tileId > -1)
+      if (featureTexels && pixel::alpha(featureTexels[textureY]) == 255)
       {
-        color = m_tileTextures[featureTile->tileId].getPixel(info.textureX, textureY);
+        color = featureTexels[textureY];
+      }
 
-        if (color.a == 255)
-        {
-          color = computeIntensity(
-              color,
-              INTENSITY, MULTIPLIER, info.wallDist);
+      slice[count++] = color;
+    }
+  }
+  else
+  {
+    for (int y = wallStart; y < wallEnd; y++)
+    {
+      int d, textureY;
 
-          buffer.setPixel(x, y, color);
-        }
+      d = y * 256 - m_height * 128 + lineHeight * 128;
+      textureY = std::min((((d * config::TILE_H) / lineHeight) / 256) >> mip, mipHeight - 1);
+
+      sf::Uint32 color = texels[textureY];
+
+      if (featureTexels && pixel::alpha(featureTexels[textureY]) == 255)
+      {
+        color = featureTexels[textureY];
       }
+
+      slice[count++] = color;
     }
-    else
+  }
+
+  if (preshaded)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      dest[(wallStart + i) * m_width] = slice[i] | pixel::Black;
+    }
+
+    return;
+  }
+
+  // The whole slice is at the same distance.
+  m_shading.shadeSpan(slice, count, level);
+
+  for (int i = 0; i < count; i++)
+  {
+    dest[(wallStart + i) * m_width] = slice[i];
+  }
+}
+
+void Raycaster::drawWallSliceIndexed(const RayInfo& info, int x, int lineHeight, int wallStart, int wallEnd, int tileId)
+{
+  const Tile* featureTile = tileId > -1 ? m_tilemap->getTileAt(info.mapX, info.mapY, LAYER_WALLFEATURE) : nullptr;
+
+  wallStart = std::max(wallStart, 0);
+  wallEnd = std::min(wallEnd, m_height);
+
+  sf::Uint8* dest = &m_indexedFramebuffer[x];
+
+  if (tileId < 0 || lineHeight <= 0)
+  {
+    for (int y = wallStart; y < wallEnd; y++)
+    {
+      dest[y * m_width] = Palette::TRANSPARENT_INDEX;
+    }
+
+    return;
+  }
+
+  const int level = m_shading.getLevel(INTENSITY * MULTIPLIER * info.light / 256.0f, info.wallDist);
+  const sf::Uint8* colormap = m_palette.getColormap(level);
+
+  const int mip = getMipLevel(lineHeight);
+  const int mipHeight = m_mips[mip].height;
+
+  const sf::Uint8* texels = getWallIndices(tileId, mip, info.textureX);
+  const sf::Uint8* featureTexels = 0;
+
+  if (featureTile && featureTile->tileId > -1)
+  {
+    featureTexels = getWallIndices(featureTile->tileId, mip, info.textureX);
+  }
+
+  // Always stepped in 16.16 fixed point, like the fixed point RGBA path.
+  sf::Uint32 step = ((sf::Uint32)config::TILE_H << FIXED_SHIFT) / lineHeight;
+  sf::Uint32 position = (sf::Uint32)(((int64_t)std::max(0, 2 * wallStart - m_height + lineHeight) * config::TILE_H << FIXED_SHIFT) / (2 * lineHeight));
+
+  for (int y = wallStart; y < wallEnd; y++, position += step)
+  {
+    int textureY = std::min((int)(position >> (FIXED_SHIFT + mip)), mipHeight - 1);
+
+    sf::Uint8 index = texels[textureY];
+
+    if (featureTexels && featureTexels[textureY] != Palette::TRANSPARENT_INDEX)
     {
-      buffer.setPixel(x, y, sf::Color::Black);
+      index = featureTexels[textureY];
     }
+
+    dest[y * m_width] = colormap[index];
   }
 }
 
-void Raycaster::drawFloorsCeiling(const RayInfo& info, int x, int wallEnd, sf::Image& buffer)
+void Raycaster::drawFloorsCeiling(const RayInfo& info, int x, int wallEnd)
 {
   float cameraDist = 0;
 
+  const int mapWidth = m_tilemap->getWidth();
+  const int mapHeight = m_tilemap->getHeight();
+  const Tile* floorTiles = m_tilemap->getLayerTiles(LAYER_FLOOR);
+  const Tile* ceilTiles = m_tilemap->getLayerTiles(LAYER_CEILING);
+
   for (int y = wallEnd; y < m_height; y++) 
   {
     int floorTextureX, floorTextureY;
@@ -189,116 +703,415 @@ void Raycaster::drawFloorsCeiling(const RayInfo& info, int x, int wallEnd, sf::I
     if (floorTextureX < 0 || floorTextureY < 0)
       continue;
 
-    Tile* floorTile = m_tilemap->getTileAt((int) currentFloorX, (int) currentFloorY, "floor");
-    Tile* ceilTile = m_tilemap->getTileAt((int) currentFloorX, (int) currentFloorY, "ceiling");
+    int floorIndex = -1;
+    int ceilIndex = -1;
+    int floorLevel = m_floorLevels[y];
+    int ceilLevel = m_ceilingLevels[y];
+
+    int mapX = (int) currentFloorX;
+    int mapY = (int) currentFloorY;
+
+    if (mapX < mapWidth && mapY < mapHeight)
+    {
+      int tileIndex = mapY * mapWidth + mapX;
+
+      floorIndex = floorTiles ? floorTiles[tileIndex].tileId : -1;
+      ceilIndex = ceilTiles ? ceilTiles[tileIndex].tileId : -1;
+
+      if (m_lightMap)
+      {
+        floorLevel = getLitLevel(m_floorScales[y], m_lightMap[tileIndex]);
+        ceilLevel = getLitLevel(m_ceilingScales[y], m_lightMap[tileIndex]);
+      }
+    }
+
+    const int mip = m_rowMips[y];
 
-    int floorIndex = floorTile ? floorTile->tileId : -1;
-    int ceilIndex = ceilTile ? ceilTile->tileId : -1;
+    if (m_indexed)
+    {
+      if (floorIndex > -1)
+        m_indexedFramebuffer[y * m_width + x] = m_palette.getColormap(floorLevel)[getFloorIndex(floorIndex, mip, floorTextureX, floorTextureY)];
+
+      if (ceilIndex > -1)
+        m_indexedFramebuffer[(m_height - y) * m_width + x] = m_palette.getColormap(ceilLevel)[getFloorIndex(ceilIndex, mip, floorTextureX, floorTextureY)];
+
+      continue;
+    }
 
     // Floor
     if (floorIndex > -1)
     {
-      sf::Color color = computeIntensity(
-          m_tileTextures[floorIndex].getPixel(floorTextureX, floorTextureY),
-          0.75, 1.0, currentDist);
-      buffer.setPixel(x, y, color);
+      m_framebuffer[y * m_width + x] = m_shading.shade(getFloorTexel(floorIndex, mip, floorTextureX, floorTextureY), floorLevel);
     }
 
     // Ceiling
     if (ceilIndex > -1)
     {
-      sf::Color color = computeIntensity(
-          m_tileTextures[ceilIndex].getPixel(floorTextureX, floorTextureY),
-          INTENSITY, MULTIPLIER, currentDist);
-      buffer.setPixel(x, m_height - y, color);
+      m_framebuffer[(m_height - y) * m_width + x] = m_shading.shade(getFloorTexel(ceilIndex, mip, floorTextureX, floorTextureY), ceilLevel);
     }
   }
 }
 
-void Raycaster::drawSprites(sf::Image& buffer, Direction pDir)
+void Raycaster::drawFloorCeilingRows(int startY, int endY)
 {
-  m_entities.sort([=](const Entity* lhs, const Entity* rhs) -> bool
-    {
-      float leftDistance = (m_camera->pos.x - lhs->x) * (m_camera->pos.x - lhs->x) +
-                           (m_camera->pos.y - lhs->y) * (m_camera->pos.y - lhs->y);
-      float rightDistance = (m_camera->pos.x - rhs->x) * (m_camera->pos.x - rhs->x) +
-                            (m_camera->pos.y - rhs->y) * (m_camera->pos.y - rhs->y);
-  
-      return leftDistance > rightDistance;
-    });
+  const int mapWidth = m_tilemap->getWidth();
+  const int mapHeight = m_tilemap->getHeight();
+  const Tile* floorTiles = m_tilemap->getLayerTiles(LAYER_FLOOR);
+  const Tile* ceilTiles = m_tilemap->getLayerTiles(LAYER_CEILING);
 
-  for (auto sprIter = m_entities.begin(); sprIter != m_entities.end(); ++sprIter)
+  // Ray through the leftmost column.
+  const float rayDirX = m_camera->dir.x - m_camera->plane.x;
+  const float rayDirY = m_camera->dir.y - m_camera->plane.y;
+
+  for (int y = startY; y < endY; y++)
   {
-    if (!(*sprIter)->isVisible())
+    float rowDist = (float)m_height / (2.0f * y - m_height);
+
+    // The floor position moves linearly across a row.
+    float stepX = rowDist * 2.0f * m_camera->plane.x / m_width;
+    float stepY = rowDist * 2.0f * m_camera->plane.y / m_width;
+
+    float currentFloorX = m_camera->pos.x + rowDist * rayDirX;
+    float currentFloorY = m_camera->pos.y + rowDist * rayDirY;
+
+    const int mip = m_rowMips[y];
+
+    sf::Uint32* floorRow = &m_framebuffer[y * m_width];
+    sf::Uint32* ceilRow = &m_framebuffer[(m_height - y) * m_width];
+
+    sf::Uint8* indexedFloorRow = m_indexed ? &m_indexedFramebuffer[y * m_width] : 0;
+    sf::Uint8* indexedCeilRow = m_indexed ? &m_indexedFramebuffer[(m_height - y) * m_width] : 0;
+    const sf::Uint8* floorColormap = m_indexed ? m_palette.getColormap(m_floorLevels[y]) : 0;
+    const sf::Uint8* ceilColormap = m_indexed ? m_palette.getColormap(m_ceilingLevels[y]) : 0;
+
+    for (int x = 0; x < m_width; x++, currentFloorX += stepX, currentFloorY += stepY)
+    {
+      int floorTextureX = (int)(currentFloorX * config::TILE_W) % config::TILE_W;
+      int floorTextureY = (int)(currentFloorY * config::TILE_H) % config::TILE_H;
+
+      if (floorTextureX < 0 || floorTextureY < 0)
+        continue;
+
+      int mapX = (int) currentFloorX;
+      int mapY = (int) currentFloorY;
+
+      if (mapX >= mapWidth || mapY >= mapHeight)
+        continue;
+
+      int tileIndex = mapY * mapWidth + mapX;
+
+      int floorIndex = floorTiles ? floorTiles[tileIndex].tileId : -1;
+      int ceilIndex = ceilTiles ? ceilTiles[tileIndex].tileId : -1;
+
+      if (m_indexed)
+      {
+        if (m_lightMap)
+        {
+          floorColormap = m_palette.getColormap(getLitLevel(m_floorScales[y], m_lightMap[tileIndex]));
+          ceilColormap = m_palette.getColormap(getLitLevel(m_ceilingScales[y], m_lightMap[tileIndex]));
+        }
+
+        if (floorIndex > -1)
+          indexedFloorRow[x] = floorColormap[getFloorIndex(floorIndex, mip, floorTextureX, floorTextureY)];
+
+        if (ceilIndex > -1)
+          indexedCeilRow[x] = ceilColormap[getFloorIndex(ceilIndex, mip, floorTextureX, floorTextureY)];
+
+        continue;
+      }
+
+      if (floorIndex > -1)
+      {
+        floorRow[x] = getFloorTexel(floorIndex, mip, floorTextureX, floorTextureY);
+      }
+
+      if (ceilIndex > -1)
+      {
+        ceilRow[x] = getFloorTexel(ceilIndex, mip, floorTextureX, floorTextureY);
+      }
+
+      // Lit tiles differ in brightness along the row, so shade them one
+      // by one.
+      if (m_lightMap)
+      {
+        int light = m_lightMap[tileIndex];
+
+        if (floorIndex > -1)
+          floorRow[x] = m_shading.shade(floorRow[x], getLitLevel(m_floorScales[y], light));
+
+        if (ceilIndex > -1)
+          ceilRow[x] = m_shading.shade(ceilRow[x], getLitLevel(m_ceilingScales[y], light));
+      }
+    }
+
+    if (m_lightMap || m_indexed)
     {
       continue;
     }
 
-    float spriteX = 0.5f + ((*sprIter)->x - m_camera->pos.x);
-    float spriteY = 0.5f + ((*sprIter)->y - m_camera->pos.y);
+    // Everything on a row is at the same distance. Untouched pixels are
+    // black and stay black.
+    m_shading.shadeSpan(floorRow, m_width, m_floorLevels[y]);
+    m_shading.shadeSpan(ceilRow, m_width, m_ceilingLevels[y]);
+  }
+}
+
+void Raycaster::drawSprites(Direction pDir)
+{
+  // Tile the camera looks out from. Nudged forward since the camera may sit
+  // right on the edge of the wall behind it.
+  const int viewX = (int)(m_camera->pos.x + m_camera->dir.x * 0.01f);
+  const int viewY = (int)(m_camera->pos.y + m_camera->dir.y * 0.01f);
+
+  for (auto it = m_sprites.begin(); it != m_sprites.end(); ++it)
+  {
+    projectSprite(*it, viewX, viewY);
+  }
+
+  sortSprites();
 
-    float invDet = 1.0f / (m_camera->plane.x * m_camera->dir.y - m_camera->dir.x * m_camera->plane.y);
+  for (auto it = m_sprites.begin(); it != m_sprites.end(); ++it)
+  {
+    const SpriteInfo& info = *it;
 
-    float transformX = invDet * (m_camera->dir.y * spriteX - m_camera->dir.x * spriteY);
-    float transformY = invDet * (-m_camera->plane.y * spriteX + m_camera->plane.x * spriteY);
+    if (info.culled)
+    {
+      continue;
+    }
 
-    int spriteScreenX = static_cast<int>(
-        static_cast<float>((m_width / 2)) * (1.0f + transformX / transformY)
-      );
+    const Sprite* sprite = info.entity->sprite();
+    const sf::Image& spriteImage = sprite->getImage(pDir);
+    const sf::Uint8* spritePixels = spriteImage.getPixelsPtr();
+    const int spriteImageWidth = spriteImage.getSize().x;
+    const int light = getLight((int)info.entity->x, (int)info.entity->y);
+    const int level = m_shading.getLevel(INTENSITY * MULTIPLIER * light / 256.0f, info.depth);
 
-    // Height of sprite
-    int spriteHeight = abs( static_cast<int> ( static_cast<float>(m_height) / transformY) );
+    const int spriteLeft = -info.size / 2 + info.screenX;
 
-    int drawStartY = -spriteHeight / 2 + m_height / 2;
+    int drawStartY = -info.size / 2 + m_height / 2;
     if (drawStartY < 0) drawStartY = 0;
 
-    int drawEndY = spriteHeight / 2 + m_height / 2;
+    int drawEndY = info.size / 2 + m_height / 2;
     if (drawEndY >= m_height) drawEndY = m_height;
 
-    // Width of sprite
-    int spriteWidth = abs( static_cast<int> ( static_cast<float>(m_height) / transformY) );
+    if (m_fixedPoint)
+    {
+      drawSpriteFixed(info, spritePixels, spriteImageWidth, level, drawStartY, drawEndY);
+      continue;
+    }
 
-    int drawStartX = -spriteWidth / 2 + spriteScreenX;
-    if (drawStartX < 0) drawStartX = 0;
+    for (int x = info.startX; x < info.endX; x++)
+    {
+      if (info.depth >= m_zbuffer[x])
+      {
+        continue;
+      }
 
-    int drawEndX = spriteWidth / 2 + spriteScreenX;
-    if (drawEndX < 0) drawEndX = 0;
-    if (drawEndX >= m_width) drawEndX = m_width;
+      int texX = static_cast<int>(
+        256 * (x - spriteLeft) * sprite->getWidth() / info.size
+      ) / 256;
 
-    if (drawStartX < drawEndX)
-    {
-      const sf::Image& spriteImage = (*sprIter)->sprite()->getImage(pDir);
-      
-      for (int x = drawStartX; x < drawEndX; x++)
+      for (int y = drawStartY; y < drawEndY; y++)
       {
-        int texX = static_cast<int>(
-          256 * (x - (-spriteWidth / 2 + spriteScreenX)) * (*sprIter)->sprite()->getWidth() /*config::TILE_SIZE*/ / spriteWidth
-        ) / 256;
+        int d = y * 256 - m_height * 128 + info.size * 128;
+        int texY = ((d * sprite->getHeight()) / info.size) / 256;
 
-        if (transformY > 0 && x >= 0 && x < m_width && transformY < zbuffer[x])
+        sf::Uint32 color = pixel::fromBytes(spritePixels + (texY * spriteImageWidth + texX) * 4);
+
+        if (pixel::alpha(color) == 255)
         {
-          for (int y = drawStartY; y < drawEndY; y++)
-          {
-            int d = y * 256 - m_height * 128 + spriteHeight * 128;
-            int texY = ((d * (*sprIter)->sprite()->getHeight() /*config::TILE_SIZE*/) / spriteHeight) / 256;
-
-            sf::Color color = spriteImage.getPixel(texX, texY);
-
-            if (color.a == 255)
-            {
-              color = computeIntensity(color, INTENSITY, MULTIPLIER, transformY);
-              buffer.setPixel(x, y, color);
-            }
-          }
+          m_framebuffer[y * m_width + x] = m_shading.shade(color, level);
         }
+      }
+    }
+  }
+}
+
+void Raycaster::drawSpriteFixed(const SpriteInfo& info, const sf::Uint8* spritePixels, int spriteImageWidth,
+                                int level, int drawStartY, int drawEndY)
+{
+  const Sprite* sprite = info.entity->sprite();
+  const int spriteLeft = -info.size / 2 + info.screenX;
+
+  // Texture coordinates in 16.16 fixed point, stepped per pixel.
+  const sf::Uint32 stepX = ((sf::Uint32)sprite->getWidth() << FIXED_SHIFT) / info.size;
+  const sf::Uint32 stepY = ((sf::Uint32)sprite->getHeight() << FIXED_SHIFT) / info.size;
+  const sf::Uint32 startY = (sf::Uint32)(((int64_t)std::max(0, 2 * drawStartY - m_height + info.size) * sprite->getHeight() << FIXED_SHIFT) / (2 * info.size));
+
+  sf::Uint32 texX = (sf::Uint32)(info.startX - spriteLeft) * stepX;
+
+  for (int x = info.startX; x < info.endX; x++, texX += stepX)
+  {
+    if (info.depth >= m_zbuffer[x])
+    {
+      continue;
+    }
 
+    const sf::Uint8* column = spritePixels + (texX >> FIXED_SHIFT) * 4;
+    sf::Uint32* dest = &m_framebuffer[drawStartY * m_width + x];
+
+    sf::Uint32 texY = startY;
+
+    for (int y = drawStartY; y < drawEndY; y++, texY += stepY, dest += m_width)
+    {
+      sf::Uint32 color = pixel::fromBytes(column + (texY >> FIXED_SHIFT) * spriteImageWidth * 4);
+
+      if (pixel::alpha(color) == 255)
+      {
+        *dest = m_shading.shade(color, level);
       }
     }
+  }
+}
+
+void Raycaster::projectSprite(SpriteInfo& info, int viewX, int viewY) const
+{
+  const Entity* entity = info.entity;
+
+  float spriteX = 0.5f + (entity->x - m_camera->pos.x);
+  float spriteY = 0.5f + (entity->y - m_camera->pos.y);
+
+  info.distance = (m_camera->pos.x - entity->x) * (m_camera->pos.x - entity->x) +
+                  (m_camera->pos.y - entity->y) * (m_camera->pos.y - entity->y);
+  info.culled = true;
+
+  if (!entity->isVisible())
+  {
+    return;
+  }
+
+  // Walls are in the way from wherever in the tile the camera is.
+  if (!m_tilemap->isPotentiallyVisible(viewX, viewY, (int)entity->x, (int)entity->y))
+  {
+    return;
+  }
+
+  float invDet = 1.0f / (m_camera->plane.x * m_camera->dir.y - m_camera->dir.x * m_camera->plane.y);
+
+  float transformX = invDet * (m_camera->dir.y * spriteX - m_camera->dir.x * spriteY);
+  float transformY = invDet * (-m_camera->plane.y * spriteX + m_camera->plane.x * spriteY);
+
+  // Behind the camera.
+  if (transformY <= 0)
+  {
+    return;
+  }
+
+  info.depth = transformY;
+  info.screenX = static_cast<int>(
+      static_cast<float>((m_width / 2)) * (1.0f + transformX / transformY)
+    );
+  info.size = abs( static_cast<int> ( static_cast<float>(m_height) / transformY) );
+
+  if (info.size == 0)
+  {
+    return;
+  }
+
+  info.startX = -info.size / 2 + info.screenX;
+  if (info.startX < 0) info.startX = 0;
+
+  info.endX = info.size / 2 + info.screenX;
+  if (info.endX < 0) info.endX = 0;
+  if (info.endX >= m_width) info.endX = m_width;
 
+  // Outside the field of view, or hidden behind walls in every column.
+  for (int x = info.startX; x < info.endX; x++)
+  {
+    if (transformY < m_zbuffer[x])
+    {
+      info.culled = false;
+      break;
+    }
   }
 }
 
-Raycaster::RayInfo Raycaster::castRay(int x, int width) const
+void Raycaster::sortSprites()
+{
+  // Insertion sort, far to near. The order rarely changes from one frame to
+  // the next so this is close to a single pass.
+  for (size_t i = 1; i < m_sprites.size(); i++)
+  {
+    if (m_sprites[i - 1].distance >= m_sprites[i].distance)
+    {
+      continue;
+    }
+
+    SpriteInfo info = m_sprites[i];
+    size_t j = i;
+
+    while (j > 0 && m_sprites[j - 1].distance < info.distance)
+    {
+      m_sprites[j] = m_sprites[j - 1];
+      j--;
+    }
+
+    m_sprites[j] = info;
+  }
+}
+
+const Raycaster::ColumnRay* Raycaster::findRayTable()
+{
+  const Vec2& dir = m_camera->dir;
+  const Vec2& plane = m_camera->plane;
+
+  bool turning = dir.x != m_lastDir.x || dir.y != m_lastDir.y ||
+                 plane.x != m_lastPlane.x || plane.y != m_lastPlane.y;
+
+  m_lastDir = dir;
+  m_lastPlane = plane;
+
+  for (int i = 0; i < NUMBER_OF_RAY_TABLES; i++)
+  {
+    RayTable& table = m_rayTables[i];
+
+    if (!table.columns.empty() &&
+        table.dir.x == dir.x && table.dir.y == dir.y &&
+        table.plane.x == plane.x && table.plane.y == plane.y)
+    {
+      return &table.columns[0];
+    }
+  }
+
+  if (turning)
+  {
+    return 0;
+  }
+
+  // Replace the oldest table.
+  RayTable& table = m_rayTables[m_nextRayTable];
+  m_nextRayTable = (m_nextRayTable + 1) % NUMBER_OF_RAY_TABLES;
+
+  table.dir = dir;
+  table.plane = plane;
+  table.columns.resize(m_width);
+
+  for (int x = 0; x < m_width; x++)
+  {
+    table.columns[x] = makeColumnRay(x, m_width);
+  }
+
+  return &table.columns[0];
+}
+
+Raycaster::ColumnRay Raycaster::makeColumnRay(int x, int width) const
+{
+  ColumnRay column;
+
+  float camX = 2.0f * (float)x / (float)width - 1.0f;
+  column.dir = Vec2(m_camera->dir.x + m_camera->plane.x * camX,
+                    m_camera->dir.y + m_camera->plane.y * camX);
+
+  column.ddx = sqrt(1.0f + (column.dir.y * column.dir.y) / (column.dir.x * column.dir.x));
+  column.ddy = sqrt(1.0f + (column.dir.x * column.dir.x) / (column.dir.y * column.dir.y));
+
+  column.stepX = column.dir.x < 0 ? -1 : 1;
+  column.stepY = column.dir.y < 0 ? -1 : 1;
+
+  return column;
+}
+
+Raycaster::RayInfo Raycaster::castRay(int x, int width, RayInfo& doorInfo) const
 {
   int mapX, mapY;
   float sideDistX, sideDistY;
@@ -310,58 +1123,102 @@ Raycaster::RayInfo Raycaster::castRay(int x, int width) const
   int textureX;
   float floorXWall, floorYWall;
   
-  float camX = 2.0f * (float)x / (float)width - 1.0f;
+  const ColumnRay column = m_columnRays ? m_columnRays[x] : makeColumnRay(x, width);
+
   Vec2 ray = m_camera->pos;
-  Vec2 rayDir(m_camera->dir.x + m_camera->plane.x * camX,
-              m_camera->dir.y + m_camera->plane.y * camX);
+  const Vec2& rayDir = column.dir;
   
   mapX = (int) ray.x;
   mapY = (int) ray.y;
+
+  const Tile* walls = m_tilemap->getLayerTiles(LAYER_WALL);
+  const int mapWidth = m_tilemap->getWidth();
+
+  doorInfo.door = 0;
   
-  ddx = sqrt(1.0f + (rayDir.y * rayDir.y) / (rayDir.x * rayDir.x));
-  ddy = sqrt(1.0f + (rayDir.x * rayDir.x) / (rayDir.y * rayDir.y));
+  ddx = column.ddx;
+  ddy = column.ddy;
+  stepX = column.stepX;
+  stepY = column.stepY;
   
-  if (rayDir.x < 0)
+  if (stepX < 0)
   {
-    stepX = -1;
     sideDistX = (ray.x - mapX) * ddx;
   }
   else
   {
-    stepX = 1;
     sideDistX = (mapX + 1.0f - ray.x) * ddx; 
   }
   
-  if (rayDir.y < 0)
+  if (stepY < 0)
   {
-    stepY = -1;
     sideDistY = (ray.y - mapY) * ddy;
   }
   else
   {
-    stepY = 1;
     sideDistY = (mapY + 1.0f - ray.y) * ddy;
   }
   
-  while (1)
+  // Look at the tile the ray just stepped into. True when the ray stops.
+  auto hitTile = [&]() -> bool
   {
-    if (sideDistX < sideDistY)
-    {
-      sideDistX += ddx;
-      mapX += stepX;
-      side = 0;
-    } 
-    else
+    if (outOfBounds(mapX, mapY))
     {
-      sideDistY += ddy;
-      mapY += stepY;
-      side = 1;
+      return true;
     }
-    
-    if (outOfBounds(mapX, mapY) || m_tilemap->getTileAt(mapX, mapY, "wall")->tileId != -1)
+
+    // The nearest door is resolved on the way to the wall behind it. Rays
+    // passing through the open part of a door keep looking for another.
+    const Door* door = m_doorGrid[mapY * mapWidth + mapX];
+
+    if (door && !doorInfo.door)
     {
-      break;
+      castDoor(door, mapX, mapY, side, stepX, stepY, ray, rayDir, doorInfo);
     }
+
+    return walls[mapY * mapWidth + mapX].tileId != -1;
+  };
+
+  if (m_fixedPoint)
+  {
+    sf::Uint32 fixedSideX = _to_fixed(sideDistX);
+    sf::Uint32 fixedSideY = _to_fixed(sideDistY);
+    sf::Uint32 fixedDdx = _to_fixed(ddx);
+    sf::Uint32 fixedDdy = _to_fixed(ddy);
+
+    do
+    {
+      if (fixedSideX < fixedSideY)
+      {
+        fixedSideX += fixedDdx;
+        mapX += stepX;
+        side = 0;
+      }
+      else
+      {
+        fixedSideY += fixedDdy;
+        mapY += stepY;
+        side = 1;
+      }
+    } while (!hitTile());
+  }
+  else
+  {
+    do
+    {
+      if (sideDistX < sideDistY)
+      {
+        sideDistX += ddx;
+        mapX += stepX;
+        side = 0;
+      } 
+      else
+      {
+        sideDistY += ddy;
+        mapY += stepY;
+        side = 1;
+      }
+    } while (!hitTile());
   }
   
   if (side == 0)
@@ -418,91 +1275,23 @@ Raycaster::RayInfo Raycaster::castRay(int x, int width) const
     floorXWall,
     floorYWall,
     textureX,
-    side
+    side,
+    0,
+    // Walls are lit from the open tile the ray came from.
+    side == 0 ? getLight(mapX - stepX, mapY) : getLight(mapX, mapY - stepY)
   };
   
   return info;
 }
 
-Raycaster::RayInfo Raycaster::castDoorRay(int x, int width) const
+bool Raycaster::castDoor(const Door* door, int mapX, int mapY, int side, int stepX, int stepY,
+                         const Vec2& ray, const Vec2& rayDir, RayInfo& info) const
 {
-  int mapX, mapY;
-  float sideDistX, sideDistY;
-  float ddx, ddy;
   float wallDist;
-  int stepX, stepY;
-  int side;
   float wallX;
   int textureX;
 
-  float camX = 2.0f * (float)x / (float)width - 1.0f;
-  Vec2 ray = m_camera->pos;
-  Vec2 rayDir(m_camera->dir.x + m_camera->plane.x * camX,
-              m_camera->dir.y + m_camera->plane.y * camX);
-
-  mapX = (int) ray.x;
-  mapY = (int) ray.y;
-
-  ddx = sqrt(1.0f + (rayDir.y * rayDir.y) / (rayDir.x * rayDir.x));
-  ddy = sqrt(1.0f + (rayDir.x * rayDir.x) / (rayDir.y * rayDir.y));
-
-  if (rayDir.x < 0)
-  {
-    stepX = -1;
-    sideDistX = (ray.x - mapX) * ddx;
-  }
-  else
-  {
-    stepX = 1;
-    sideDistX = (mapX + 1.0f - ray.x) * ddx;
-  }
-
-  if (rayDir.y < 0)
-  {
-    stepY = -1;
-    sideDistY = (ray.y - mapY) * ddy;
-  }
-  else
-  {
-    stepY = 1;
-    sideDistY = (mapY + 1.0f - ray.y) * ddy;
-  }
-
-  const Door* door = nullptr;
-
-stepping:
-  while (1)
-  {
-    if (sideDistX < sideDistY)
-    {
-      sideDistX += ddx;
-      mapX += stepX;
-      side = 0;
-    }
-    else
-    {
-      sideDistY += ddy;
-      mapY += stepY;
-      side = 1;
-    }
-
-    if (outOfBounds(mapX, mapY))
-    {
-      RayInfo failedInfo{};
-      failedInfo.side = -1;
-      return failedInfo;
-    }
-    else if ((door = getDoorAt(mapX, mapY)))
-    {
-//      if (door->isVisible())
-//      {
-        break;
-//      }
-    }
-  }
-
-  bool verticalDoor = m_tilemap->getTileAt(mapX, mapY - 1, "wall")->tileId != -1 &&
-                      m_tilemap->getTileAt(mapX, mapY + 1, "wall")->tileId != -1;
+  bool verticalDoor = isWall(mapX, mapY - 1) && isWall(mapX, mapY + 1);
 
   float mapXDiff = mapX;
   float mapYDiff = mapY;
@@ -563,7 +1352,7 @@ stepping:
   {
     if (door->getType() == Door::Door_OneWay && (wallX > door->getOpeningCount()))
     {
-      goto stepping;
+      return false;
     }
     else if (door->getType() == Door::Door_TwoWay)
     {
@@ -571,32 +1360,30 @@ stepping:
       {
         if (wallX > door->getOpeningCount() / 2)
         {
-          goto stepping;
+          return false;
         }
       }
       else
       {
         if (wallX < 0.5f+(1 - door->getOpeningCount()) / 2)
         {
-          goto stepping;
+          return false;
         }
       }
     }
   }
 
-  RayInfo info =
-  {
-    wallDist,
-    mapX,
-    mapY,
-    0,
-    0,
-    textureX,
-    side,
-    door
-  };
-
-  return info;
+  info.wallDist = wallDist;
+  info.mapX = mapX;
+  info.mapY = mapY;
+  info.floorXWall = 0;
+  info.floorYWall = 0;
+  info.textureX = textureX;
+  info.side = side;
+  info.door = door;
+  info.light = getLight(mapX, mapY);
+
+  return true;
 }
 
 bool Raycaster::sameCoord(const RayInfo& a, const RayInfo& b) const
@@ -606,14 +1393,14 @@ bool Raycaster::sameCoord(const RayInfo& a, const RayInfo& b) const
 
 const Entity* Raycaster::getEntityAt(int x, int y) const
 {
-  for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
+  for (auto it = m_sprites.begin(); it != m_sprites.end(); ++it)
   {
-    int px = (*it)->x;
-    int py = (*it)->y;
+    int px = it->entity->x;
+    int py = it->entity->y;
 
     if (px == x && py == y)
     {
-      return *it;
+      return it->entity;
     }
   }
 
@@ -622,17 +1409,19 @@ const Entity* Raycaster::getEntityAt(int x, int y) const
 
 const Door* Raycaster::getDoorAt(int x, int y) const
 {
-  auto it = std::find_if(m_doors.begin(), m_doors.end(), [&x, &y](const Door* door)
+  if (outOfBounds(x, y))
   {
-    return (int)door->x == x && (int)door->y == y;
-  });
-
-  if (it != m_doors.end())
-  {
-    return *it;
+    return nullptr;
   }
 
-  return nullptr;
+  return m_doorGrid[y * m_tilemap->getWidth() + x];
+}
+
+bool Raycaster::isWall(int mapX, int mapY) const
+{
+  const Tile* tile = m_tilemap->getTileAt(mapX, mapY, LAYER_WALL);
+
+  return tile && tile->tileId != -1;
 }
 
 bool Raycaster::outOfBounds(int mapX, int mapY) const
@@ -1,26 +1,86 @@
 #ifndef RAYCASTER_H
 #define RAYCASTER_H
 
-#include <list>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
 
 #include <SFML/Graphics.hpp>
 
+#include "Config.h"
 #include "Vec2.h"
 #include "Camera.h"
 #include "Direction.h"
+#include "Shading.h"
+#include "Palette.h"
 
 class Entity;
 class Door;
+class WorkerPool;
 class Map;
 class Tile;
 
 class Raycaster
 {
 public:
+  /// Nanoseconds spent in each stage of the last raycast.
+  struct Stats
+  {
+    int64_t walls;
+    int64_t floors;
+    int64_t doors;
+    int64_t sprites;
+  };
+
+  /// How floors and ceilings are cast. Per column together with the walls,
+  /// or one screen row at a time before the walls are drawn on top.
+  enum FloorMode
+  {
+    FLOOR_COLUMNS,
+    FLOOR_SCANLINES
+  };
+
   Raycaster(int width, int height);
+  ~Raycaster();
 
-  void raycast(Camera* camera, sf::Image& buffer, Direction pDir = DIR_RANDOM);
-  
+  void raycast(Camera* camera, Direction pDir = DIR_RANDOM);
+
+  /// RGBA pixels of the last raycast, width * height * 4 bytes. Suitable for
+  /// sf::Texture::update.
+  const sf::Uint8* getPixels() const
+  {
+    return reinterpret_cast<const sf::Uint8*>(&m_framebuffer[0]);
+  }
+
+  int getWidth() const { return m_width; }
+  int getHeight() const { return m_height; }
+
+  /// Change the resolution rendered at.
+  void resize(int width, int height);
+
+  /// Forget the cached per column ray tables. Needed if the camera's field of
+  /// view (Camera::plane) is changed without turning it. Done by resize.
+  void invalidateRayTables();
+
+  void setFloorMode(FloorMode mode) { m_floorMode = mode; }
+  FloorMode getFloorMode() const { return m_floorMode; }
+
+  /// Use 16.16 fixed point for ray stepping and texture coordinates instead
+  /// of floats and per pixel divides.
+  void setFixedPoint(bool enabled) { m_fixedPoint = enabled; }
+  bool getFixedPoint() const { return m_fixedPoint; }
+
+  /// True if walls, floors and ceilings are rendered with 8 bit palette
+  /// indices (RAYCASTER_INDEXED). Sprites are always drawn in RGBA.
+  bool getIndexed() const { return m_indexed; }
+
+  /// Collect Stats for every raycast. Rendering happens on the calling
+  /// thread only while enabled.
+  void setProfiling(bool enabled) { m_profiling = enabled; }
+  const Stats& getStats() const { return m_stats; }
+
+  /// Also drops all entities and doors, add the new map's afterwards.
   void setTilemap(Map* tilemap);
   
   void addEntity(const Entity* entity);
@@ -28,13 +88,12 @@ public:
  
   void addDoor(const Door* door);
 
-  void clearEntities()
-  {
-    m_entities.clear();
-    m_doors.clear();
-  }
+  void clearEntities();
 
 private:
+  Raycaster(const Raycaster&);
+  Raycaster& operator=(const Raycaster&);
+
   struct RayInfo {
     float wallDist;
     int mapX, mapY;
@@ -42,22 +101,142 @@ private:
     int textureX;
     int side;
     const Door* door; // When drawing doors.
+    int light;        // Of the tile in front of the wall, 8.8 fixed point.
+  };
+
+  // An entity and its projection for the current frame.
+  struct SpriteInfo {
+    const Entity* entity;
+    float distance;   // Squared distance from the camera, used for sorting.
+    float depth;      // Distance along the view direction.
+    int screenX;
+    int size;         // Width and height on screen.
+    int startX, endX; // Visible columns, clipped to the screen.
+    bool culled;
   };
 
-  void drawWallSlice(const RayInfo& info, sf::Image& buffer, int x, int lineHeight, int wallStart, int wallEnd, int tileId);
+  void runJob(int count, int chunkSize, const std::function<void(int, int)>& job);
+
+  void drawColumns(int startX, int endX);
+  void drawWallSlice(const RayInfo& info, int x, int lineHeight, int wallStart, int wallEnd, int tileId, sf::Uint32* slice);
+  void drawWallSliceIndexed(const RayInfo& info, int x, int lineHeight, int wallStart, int wallEnd, int tileId);
+
+  struct MipLevel {
+    int width, height;
+    int offset; // Texels from the start of the tile.
+  };
 
-  RayInfo castRay(int x, int width) const;
-  RayInfo castDoorRay(int x, int width) const;
+  // Direction and DDA step of the ray through one screen column. Only
+  // depends on the camera orientation.
+  struct ColumnRay {
+    Vec2 dir;
+    float ddx, ddy;
+    int stepX, stepY;
+  };
+
+  // Column rays for one camera orientation.
+  struct RayTable {
+    Vec2 dir, plane;
+    std::vector<ColumnRay> columns;
+  };
+
+  ColumnRay makeColumnRay(int x, int width) const;
+  const ColumnRay* findRayTable();
+
+  RayInfo castRay(int x, int width, RayInfo& doorInfo) const;
+  bool castDoor(const Door* door, int mapX, int mapY, int side, int stepX, int stepY,
+                const Vec2& ray, const Vec2& rayDir, RayInfo& info) const;
 
   bool sameCoord(const RayInfo& a, const RayInfo& b) const;
 
-  void drawFloorsCeiling(const RayInfo& info, int x, int wallEnd, sf::Image& buffer);
-  void drawSprites(sf::Image& buffer, Direction pDir);
+  void drawFloorsCeiling(const RayInfo& info, int x, int wallEnd);
+  void drawFloorCeilingRows(int startY, int endY);
+  void drawSprites(Direction pDir);
+  void drawSpriteFixed(const SpriteInfo& info, const sf::Uint8* spritePixels, int spriteImageWidth,
+                       int level, int drawStartY, int drawEndY);
+  void projectSprite(SpriteInfo& info, int viewX, int viewY) const;
+  void sortSprites();
+
+  sf::Uint32 getFloorTexel(int tileId, int mip, int textureX, int textureY) const
+  {
+    const MipLevel& level = m_mips[mip];
+
+    int x = std::min(textureX >> mip, level.width - 1);
+    int y = std::min(textureY >> mip, level.height - 1);
+
+    return m_tileTexels[tileId * m_chainSize + level.offset + y * level.width + x];
+  }
+
+  const sf::Uint32* getWallColumn(int tileId, int mip, int textureX) const
+  {
+    const MipLevel& level = m_mips[mip];
+
+    int x = std::min(textureX >> mip, level.width - 1);
+
+    return &m_wallTexels[tileId * m_chainSize + level.offset + x * level.height];
+  }
+
+  sf::Uint8 getFloorIndex(int tileId, int mip, int textureX, int textureY) const
+  {
+    const MipLevel& level = m_mips[mip];
+
+    int x = std::min(textureX >> mip, level.width - 1);
+    int y = std::min(textureY >> mip, level.height - 1);
+
+    return m_tileIndices[tileId * m_chainSize + level.offset + y * level.width + x];
+  }
+
+  const sf::Uint8* getWallIndices(int tileId, int mip, int textureX) const
+  {
+    const MipLevel& level = m_mips[mip];
+
+    int x = std::min(textureX >> mip, level.width - 1);
+
+    return &m_wallIndices[tileId * m_chainSize + level.offset + x * level.height];
+  }
+
+  const sf::Uint32* getShadedColumn(int tileId, int shadingLevel, int mip, int textureX) const
+  {
+    const MipLevel& level = m_mips[mip];
+
+    int x = std::min(textureX >> mip, level.width - 1);
+    size_t tile = (size_t)m_shadedSlots[tileId] * m_shading.getLevels() + shadingLevel;
+
+    return &m_shadedTexels[tile * m_chainSize + level.offset + x * level.height];
+  }
+
+  bool isPreshaded(int tileId) const
+  {
+    return m_shadedSlots[tileId] != -1;
+  }
+
+  void preshadeTile(int tileId);
+
+  /// Light level of a map tile in 8.8 fixed point, 256 without a light map.
+  int getLight(int mapX, int mapY) const
+  {
+    if (!m_lightMap || outOfBounds(mapX, mapY))
+      return 256;
+
+    return m_lightMap[mapY * m_lightMapWidth + mapX];
+  }
+
+  /// Shading level of a floor or ceiling texel given the row's scale from
+  /// m_floorScales or m_ceilingScales and the light level of its tile.
+  int getLitLevel(int scale, int light) const
+  {
+    return std::min(m_shading.getLevels() - 1, (scale * light + (1 << 15)) >> 16);
+  }
+
+  /// Mip level for something drawn lineHeight pixels tall.
+  int getMipLevel(int lineHeight) const;
+  void updateRowMips();
 
   const Entity* getEntityAt(int x, int y) const;
   const Door* getDoorAt(int x, int y) const;
 
   bool outOfBounds(int mapX, int mapY) const;
+  bool isWall(int mapX, int mapY) const;
 
   float getDoorWallX(const Door* door, float wallX) const;
 private:
@@ -66,10 +245,91 @@ private:
   Camera* m_camera;
   Map* m_tilemap;
 
-  std::vector<sf::Image> m_tileTextures;
+  // Light map of m_tilemap for the current frame, or null if it has none.
+  // Map is only forward declared here, so its width is kept as well.
+  const int* m_lightMap;
+  int m_lightMapWidth;
+
+  // Size and position of every mip level within a tile. Level 0 is the full
+  // TILE_W * TILE_H tile and each level after it is half the size.
+  std::vector<MipLevel> m_mips;
+  int m_chainSize;
+  bool m_mipmaps;
+
+  // All tiles of the tileset with their mip levels, m_chainSize pixels each,
+  // one after another.
+  std::vector<sf::Uint32> m_tileTexels;
+
+  // The same tiles with every mip level stored column by column, so a wall
+  // slice reads its texels in order.
+  std::vector<sf::Uint32> m_wallTexels;
+
+  // Column major copies of wall tiles at every shading level, for as many
+  // tiles as fit in m_preshadeBudget bytes. Indexed by m_shadedSlots, which
+  // is -1 for tiles that are shaded when drawn.
+  std::vector<sf::Uint32> m_shadedTexels;
+  std::vector<int> m_shadedSlots;
+  size_t m_preshadeBudget;
+
+  // Indexed mode: the tileset as palette indices, laid out like
+  // m_tileTexels and m_wallTexels, which are left empty.
+  bool m_indexed;
+  Palette m_palette;
+  std::vector<sf::Uint8> m_tileIndices;
+  std::vector<sf::Uint8> m_wallIndices;
+
+  // Walls, floors and ceilings in indexed mode. Expanded into m_framebuffer
+  // before the sprites are drawn.
+  std::vector<sf::Uint8> m_indexedFramebuffer;
+
+  std::vector<sf::Uint32> m_framebuffer;
+
+  // Perpendicular wall distance per column, used to clip sprites.
+  std::vector<float> m_zbuffer;
+
+  // Null when rendering on the calling thread only.
+  WorkerPool* m_workerPool;
+
+  Shading m_shading;
+
+  // Shading level per screen row.
+  std::vector<int> m_floorLevels;
+  std::vector<int> m_ceilingLevels;
+
+  // Shading level per screen row before lighting, times 256 and not
+  // clamped, for maps with a light map.
+  std::vector<int> m_floorScales;
+  std::vector<int> m_ceilingScales;
+
+  // Floor and ceiling mip level per screen row.
+  std::vector<int> m_rowMips;
+
+  FloorMode m_floorMode;
+  bool m_fixedPoint;
+
+  bool m_profiling;
+  Stats m_stats;
+
+  // The player faces one of four directions except while turning, so a
+  // few cached orientations cover nearly every frame.
+  static const int NUMBER_OF_RAY_TABLES = 4;
+  RayTable m_rayTables[NUMBER_OF_RAY_TABLES];
+  int m_nextRayTable;
+
+  // Orientation of the previous frame. A table is only built once the
+  // camera holds still, not for every step of a turn.
+  Vec2 m_lastDir, m_lastPlane;
+
+  // Table for the current frame, or null to compute rays per column.
+  const ColumnRay* m_columnRays;
+
+  // Kept sorted far to near between frames, so sorting again is cheap while
+  // the camera moves smoothly.
+  std::vector<SpriteInfo> m_sprites;
+  std::vector<const Door*> m_doors;
 
-  std::list<const Entity*> m_entities;
-  std::list<const Door*> m_doors;
+  // The door on each map tile, or null.
+  std::vector<const Door*> m_doorGrid;
 
 };
 
@@ -31,11 +31,16 @@ static void parsePartyElement(const XMLElement* partyElement);
 static CharacterData parseCharacterElement(const XMLElement* characterElement);
 static void parseInventoryElement(const XMLElement* inventoryElement);
 static void parsePersistents(const XMLElement* persElement);
+static std::vector<bool> parseExploredRuns(const std::string& contents);
 
 void save_game(const std::string& saveFile)
 {
   TRACE("Saving game to: %s", saveFile.c_str());
 
+  // The current map is written below, the maps left earlier go through
+  // the persistents.
+  Game::instance().saveCachedMapState();
+
   std::ostringstream xml;
   xml << "<save>\n";
 
@@ -144,6 +149,8 @@ void parseMapElement(const XMLElement* mapElement)
   {
     TRACE(" - name=%s", nameAttrib->Value());
 
+    // Maps left earlier in the current session don't match the save.
+    Game::instance().clearMapCache();
     Game::instance().loadNewMap(nameAttrib->Value());
   }
 
@@ -180,16 +187,40 @@ void parseMapElement(const XMLElement* mapElement)
       std::string mapName = xml_parse_attribute<std::string>::parse(element, "name");
       std::string contents = element->GetText();
 
-      std::vector<std::string> indices_str = split_string(contents, ',');
-      std::vector<bool> indices(indices_str.size());
+      const XMLAttribute* encodingAttrib = element->FindAttribute("encoding");
+      if (encodingAttrib && std::string(encodingAttrib->Value()) == "rle")
+      {
+        Map::updateExplored(mapName, parseExploredRuns(contents));
+      }
+      else
+      {
+        // Older saves have a comma separated flag per tile.
+        std::vector<std::string> indices_str = split_string(contents, ',');
+        std::vector<bool> indices(indices_str.size());
 
-      std::transform(indices_str.begin(), indices_str.end(), indices.begin(), fromString<int>);
+        std::transform(indices_str.begin(), indices_str.end(), indices.begin(), fromString<int>);
 
-      Map::updateExplored(mapName, indices);
+        Map::updateExplored(mapName, indices);
+      }
     }
   });
 }
 
+std::vector<bool> parseExploredRuns(const std::string& contents)
+{
+  std::vector<bool> explored;
+
+  // Runs alternate between unexplored and explored tiles.
+  bool value = false;
+  for (const std::string& run : split_string(contents, ','))
+  {
+    explored.insert(explored.end(), fromString<size_t>(run), value);
+    value = !value;
+  }
+
+  return explored;
+}
+
 EntityData parseEntityElement(const XMLElement* entityElement)
 {
   TRACE("Parse Entity Element");
@@ -729,6 +729,26 @@ void Script::setCallingBattle(Battle* battle)
   m_callingBattle = battle;
 }
 
+std::vector<std::string> Script::getTransferTargets() const
+{
+  std::vector<std::string> targets;
+
+  for (auto it = m_data.begin(); it != m_data.end(); ++it)
+  {
+    if (it->opcode != OP_TRANSFER)
+      continue;
+
+    std::string targetMap = it->arguments.at("targetMap");
+
+    if (!targetMap.empty() && targetMap[0] != '$' && targetMap[0] != '%')
+    {
+      targets.push_back(targetMap);
+    }
+  }
+
+  return targets;
+}
+
 std::string Script::extractValue(const std::string& input) const
 {
   if (input.size())
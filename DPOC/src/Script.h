@@ -93,6 +93,10 @@ public:
 
   void setCallingEntity(Entity* entity);
   void setCallingBattle(Battle* battle);
+
+  /// Maps the script may transfer the player to, as given to transfer.
+  /// Targets held in variables are left out.
+  std::vector<std::string> getTransferTargets() const;
 private:
   void advance();
   void executeScriptLine();
@@ -0,0 +1,165 @@
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SHADING_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SHADING_NEON
+#endif
+
+#include "logger.h"
+
+#include "Shading.h"
+
+namespace
+{
+  const int MAX_LEVELS = 1024;
+
+  // Intensities used by the raycaster. Verification covers both.
+  const float VERIFY_INTENSITIES[] = { 0.75f * 2.0f, 0.75f * 1.0f };
+
+  const float VERIFY_MIN_DISTANCE = 0.01f;
+  const float VERIFY_MAX_DISTANCE = 128.0f;
+  const int VERIFY_STEPS = 2048;
+}
+
+sf::Uint32 computeIntensity(sf::Uint32 pixel, float objectIntensity, float multiplier, float distance)
+{
+  float intensity = objectIntensity / distance * multiplier;
+
+  // Never brighten a pixel, only darken it.
+  if (intensity > 1.0f) intensity = 1.0f;
+
+  float fr = (float) pixel::red(pixel);
+  float fg = (float) pixel::green(pixel);
+  float fb = (float) pixel::blue(pixel);
+
+  fr *= intensity;
+  fg *= intensity;
+  fb *= intensity;
+
+  return pixel::pack((sf::Uint8) fr, (sf::Uint8) fg, (sf::Uint8) fb);
+}
+
+Shading::Shading(int levels, int tolerance)
+ : m_levels(std::max(2, levels))
+{
+  build();
+
+  int error = measureError();
+
+  while (error > tolerance && m_levels < MAX_LEVELS)
+  {
+    TRACE("Shading: %d levels gives error %d (tolerance %d), increasing", m_levels, error, tolerance);
+
+    m_levels = std::min(MAX_LEVELS, m_levels * 2);
+    build();
+
+    error = measureError();
+  }
+
+  TRACE("Shading: using %d levels, max error %d", m_levels, error);
+}
+
+void Shading::build()
+{
+  m_tables.resize(m_levels * 256);
+  m_scales.resize(m_levels);
+
+  for (int level = 0; level < m_levels; level++)
+  {
+    float intensity = (float)level / (float)(m_levels - 1);
+
+    for (int c = 0; c < 256; c++)
+    {
+      m_tables[level * 256 + c] = (sf::Uint8)((float)c * intensity);
+    }
+
+    m_scales[level] = (sf::Uint16)(intensity * 256.0f + 0.5f);
+  }
+}
+
+void Shading::shadeSpan(sf::Uint32* pixels, int count, int level) const
+{
+  int i = 0;
+
+#if defined(SHADING_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i scale = _mm_set1_epi16(m_scales[level]);
+  const __m128i opaque = _mm_set1_epi32((int)pixel::Black);
+
+  // Four pixels at a time, each channel widened to 16 bits.
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+
+    __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), scale), 8);
+    __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), scale), 8);
+
+    px = _mm_or_si128(_mm_packus_epi16(lo, hi), opaque);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i), px);
+  }
+#elif defined(SHADING_NEON)
+  const uint16x8_t scale = vdupq_n_u16(m_scales[level]);
+  const uint32x4_t opaque = vdupq_n_u32(pixel::Black);
+
+  for (; i + 4 <= count; i += 4)
+  {
+    uint8x16_t px = vreinterpretq_u8_u32(vld1q_u32(pixels + i));
+
+    uint8x8_t lo = vshrn_n_u16(vmulq_u16(vmovl_u8(vget_low_u8(px)), scale), 8);
+    uint8x8_t hi = vshrn_n_u16(vmulq_u16(vmovl_u8(vget_high_u8(px)), scale), 8);
+
+    uint32x4_t result = vorrq_u32(vreinterpretq_u32_u8(vcombine_u8(lo, hi)), opaque);
+
+    vst1q_u32(pixels + i, result);
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    pixels[i] = shade(pixels[i], level);
+  }
+}
+
+int Shading::measureError() const
+{
+  int maxError = 0;
+
+  float ratio = std::pow(VERIFY_MAX_DISTANCE / VERIFY_MIN_DISTANCE, 1.0f / VERIFY_STEPS);
+
+  std::vector<sf::Uint32> span(256);
+
+  for (float objectIntensity : VERIFY_INTENSITIES)
+  {
+    float distance = VERIFY_MIN_DISTANCE;
+
+    for (int step = 0; step <= VERIFY_STEPS; step++, distance *= ratio)
+    {
+      int level = getLevel(objectIntensity, distance);
+
+      for (int c = 0; c < 256; c++)
+      {
+        span[c] = pixel::pack(c, c, c);
+      }
+
+      shadeSpan(&span[0], span.size(), level);
+
+      for (int c = 0; c < 256; c++)
+      {
+        sf::Uint32 pixel = pixel::pack(c, c, c);
+
+        int expected = pixel::red(computeIntensity(pixel, objectIntensity, 1.0f, distance));
+
+        maxError = std::max(maxError, std::abs(expected - pixel::red(shade(pixel, level))));
+        maxError = std::max(maxError, std::abs(expected - pixel::red(span[c])));
+      }
+    }
+  }
+
+  return maxError;
+}
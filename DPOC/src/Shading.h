@@ -0,0 +1,71 @@
+#ifndef SHADING_H
+#define SHADING_H
+
+#include <vector>
+
+#include <SFML/Graphics.hpp>
+
+#include "Pixel.h"
+
+/**
+ * Distance shading for the raycaster. The light intensity for a distance is
+ * quantized into a number of levels, and every level has a precomputed table
+ * mapping each channel value to its shaded value, so shading a pixel is three
+ * table lookups.
+ *
+ * The tables are checked against the original per pixel computation when
+ * created and the number of levels is raised until the result is within the
+ * given tolerance.
+ */
+class Shading
+{
+public:
+  /// tolerance is the largest allowed difference of any channel compared to
+  /// computeIntensity.
+  Shading(int levels, int tolerance);
+
+  int getLevels() const { return m_levels; }
+
+  /// Light level for an object of objectIntensity (intensity * multiplier)
+  /// at distance.
+  int getLevel(float objectIntensity, float distance) const
+  {
+    float intensity = objectIntensity / distance;
+
+    // Written like this so that inf and nan end up fully lit, just like
+    // computeIntensity does.
+    if (!(intensity < 1.0f))
+      return m_levels - 1;
+    if (intensity <= 0.0f)
+      return 0;
+
+    return (int)(intensity * (m_levels - 1) + 0.5f);
+  }
+
+  sf::Uint32 shade(sf::Uint32 pixel, int level) const
+  {
+    const sf::Uint8* table = &m_tables[level * 256];
+
+    return pixel::pack(table[pixel::red(pixel)], table[pixel::green(pixel)], table[pixel::blue(pixel)]);
+  }
+
+  /// Shade count pixels in place. Uses SIMD where available.
+  void shadeSpan(sf::Uint32* pixels, int count, int level) const;
+
+  /// Largest channel difference between this shading and computeIntensity.
+  int measureError() const;
+private:
+  void build();
+private:
+  int m_levels;
+  std::vector<sf::Uint8> m_tables;
+
+  // Fixed point (8 bit fraction) scale per level, used by the SIMD path.
+  std::vector<sf::Uint16> m_scales;
+};
+
+/// Reference shading. Darkens pixel by objectIntensity / distance * multiplier
+/// without ever making it brighter.
+sf::Uint32 computeIntensity(sf::Uint32 pixel, float objectIntensity, float multiplier, float distance);
+
+#endif
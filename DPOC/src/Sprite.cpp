@@ -1,6 +1,7 @@
 #include "logger.h"
 #include "Cache.h"
 #include "Config.h"
+#include "Tileset.h"
 #include "Sprite.h"
 
 Sprite::Sprite()
@@ -21,6 +22,11 @@ Sprite::~Sprite()
   TRACE("Deleting sprite %s", m_textureName.c_str());
 
   cache::releaseTexture(m_textureName);
+
+  if (!m_frames.empty())
+  {
+    cache::releaseImage(m_textureName);
+  }
 }
 
 void Sprite::create(const std::string& spriteId,
@@ -31,6 +37,11 @@ void Sprite::create(const std::string& spriteId,
   {
     TRACE("Recreating sprite %s with new textureName=%s", m_textureName.c_str(), spriteId.c_str());
     cache::releaseTexture(m_textureName);
+
+    if (!m_frames.empty())
+    {
+      cache::releaseImage(m_textureName);
+    }
   }
   else
   {
@@ -57,6 +68,38 @@ void Sprite::create(const std::string& spriteId,
   {
     TRACE("Unable to create sprite %s: Texture not found!", m_textureName.c_str());
   }
+
+  buildFrames();
+}
+
+void Sprite::buildFrames()
+{
+  m_frames.clear();
+
+  // The sheet stays loaded while the sprite lives so that other sprites
+  // using it don't decode it again.
+  sf::Image* sheet = cache::loadImage(m_textureName);
+
+  if (!sheet)
+  {
+    return;
+  }
+
+  for (int direction = 0; direction < config::NUM_SPRITES_Y; direction++)
+  {
+    for (int frame = 0; frame < config::NUM_SPRITES_X; frame++)
+    {
+      int rectLeft = m_spriteSheetX * m_width * config::NUM_SPRITES_X + frame * m_width;
+      int rectTop = m_spriteSheetY * m_height * config::NUM_SPRITES_Y + direction * m_height;
+
+      sf::Image image;
+      image.create(m_width, m_height);
+      image.copy(*sheet, 0, 0, sf::IntRect(rectLeft, rectTop, m_width, m_height), true);
+      image.createMaskFromColor(sf::Color(255, 0, 255));
+
+      m_frames.push_back(image);
+    }
+  }
 }
 
 void Sprite::update(Direction direction)
@@ -142,15 +185,14 @@ const sf::Image& Sprite::getImage(Direction opposingDirection) const
     }
   }
 
-  int rectLeft = m_spriteSheetX * m_width * config::NUM_SPRITES_X + m_frame * m_width;
-  int rectTop = m_spriteSheetY * m_height * config::NUM_SPRITES_Y + direction * m_height;
+  if (m_frames.empty())
+  {
+    static sf::Image empty;
+    empty.create(m_width, m_height, sf::Color::Transparent);
+    return empty;
+  }
 
-  static sf::Image image;
-  sf::Image tempImage = m_sprite.getTexture()->copyToImage();
-  image.create(m_width, m_height);
-  image.copy(tempImage, 0, 0, sf::IntRect(rectLeft, rectTop, m_width, m_height), true);
-  image.createMaskFromColor(sf::Color(255, 0, 255));
-  return image;
+  return m_frames[direction * config::NUM_SPRITES_X + m_frame];
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -159,6 +201,8 @@ TileSprite::TileSprite(sf::Texture* tileset, int tileX, int tileY)
  : m_tileX(tileX),
    m_tileY(tileY),
    m_tileset(tileset),
+   m_tilesetName(cache::getTextureName(tileset)),
+   m_tilesetAtlas(cache::loadTileset(m_tilesetName)),
    m_image(new sf::Image)
 {
   TRACE("Creating new TileSprite. tileX=%d, tileY=%d", tileX, tileY);
@@ -175,6 +219,11 @@ TileSprite::~TileSprite()
 {
   delete m_image;
   cache::releaseTexture(m_tileset);
+
+  if (m_tilesetAtlas)
+  {
+    cache::releaseTileset(m_tilesetName);
+  }
 }
 
 void TileSprite::render(sf::RenderTarget& target, float x, float y)
@@ -206,7 +255,10 @@ const sf::Image& TileSprite::getImage(Direction) const
 
 void TileSprite::updateImage()
 {
-  sf::Image tempImage = m_sprite.getTexture()->copyToImage();
   m_image->create(m_width, m_height, sf::Color::Transparent);
-  m_image->copy(tempImage, 0, 0, sf::IntRect(m_tileX * m_width, m_tileY * m_height, m_width, m_height), true);
+
+  if (m_tilesetAtlas)
+  {
+    m_tilesetAtlas->copyTile(getTileNum(), *m_image);
+  }
 }
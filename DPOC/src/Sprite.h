@@ -1,10 +1,14 @@
 #ifndef SPRITE_H
 #define SPRITE_H
 
+#include <vector>
+
 #include <SFML/Graphics.hpp>
 
 #include "Direction.h"
 
+class Tileset;
+
 class Sprite
 {
 public:
@@ -27,6 +31,9 @@ public:
     m_frame = frame;
   }
 
+  int getFrame() const { return m_frame; }
+  Direction getDirection() const { return m_direction; }
+
   inline int getWidth() const { return m_width; }
   inline int getHeight() const { return m_height;}
 
@@ -39,6 +46,8 @@ public:
 private:
   Sprite(const Sprite&);
   Sprite& operator=(const Sprite&);
+
+  void buildFrames();
 protected:
   int m_width, m_height;
   int m_frame, m_maxFrame, m_ticksPerFrame, m_ticks;
@@ -49,6 +58,10 @@ protected:
 
   sf::Sprite m_sprite;
   std::string m_textureName;
+
+  // One image per direction and frame, color key applied. Used by the
+  // raycaster.
+  std::vector<sf::Image> m_frames;
 };
 
 class TileSprite : public Sprite
@@ -68,6 +81,11 @@ private:
 private:
   int m_tileX, m_tileY;
   sf::Texture* m_tileset;
+
+  // CPU copy of the tileset to cut tiles from, shared with the map.
+  std::string m_tilesetName;
+  Tileset* m_tilesetAtlas;
+
   sf::Image* m_image;
 };
 
@@ -3,6 +3,17 @@
 #include <sstream>
 #include <cstdlib>
 #include <iomanip>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "logger.h"
 
@@ -11,6 +22,266 @@
 
 using namespace tinyxml2;
 
+namespace
+{
+  // "DPMB" followed by the format version. Bump the version whenever the
+  // layout changes so old compiled maps are ignored.
+  const uint32_t BINARY_MAGIC = 0x424d5044;
+  const uint32_t BINARY_VERSION = 1;
+
+  // Value of a base64 character, -1 for anything else.
+  int _base64_value(char c)
+  {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+
+    return -1;
+  }
+
+  // Whitespace, which Tiled puts around the data, and padding are skipped.
+  std::vector<unsigned char> _decode_base64(const std::string& text)
+  {
+    std::vector<unsigned char> bytes;
+    bytes.reserve(text.size() * 3 / 4);
+
+    unsigned bits = 0;
+    int numberOfBits = 0;
+
+    for (auto it = text.begin(); it != text.end(); ++it)
+    {
+      int value = _base64_value(*it);
+
+      if (value < 0)
+        continue;
+
+      bits = (bits << 6) | value;
+      numberOfBits += 6;
+
+      if (numberOfBits >= 8)
+      {
+        numberOfBits -= 8;
+        bytes.push_back((bits >> numberOfBits) & 0xff);
+      }
+    }
+
+    return bytes;
+  }
+
+  // Handles both zlib and gzip streams.
+  bool _inflate(const std::vector<unsigned char>& compressed, std::vector<unsigned char>& bytes)
+  {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    // 32 added to the window bits detects the header.
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+      return false;
+
+    stream.next_in = const_cast<Bytef*>(compressed.empty() ? 0 : &compressed[0]);
+    stream.avail_in = compressed.size();
+    stream.next_out = bytes.empty() ? 0 : &bytes[0];
+    stream.avail_out = bytes.size();
+
+    int result = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+
+    return result == Z_STREAM_END && stream.avail_out == 0;
+  }
+
+  // Builds a compiled map. Strings go to a table and are referred to by
+  // index.
+  class BinaryWriter
+  {
+  public:
+    void putInt(int32_t value)
+    {
+      put(&value, sizeof(value));
+    }
+
+    void putString(const std::string& str)
+    {
+      auto it = m_stringIds.find(str);
+
+      if (it == m_stringIds.end())
+      {
+        it = m_stringIds.insert(std::make_pair(str, (int32_t)m_strings.size())).first;
+        m_strings.push_back(str);
+      }
+
+      putInt(it->second);
+    }
+
+    void putProperties(const std::map<std::string, std::string>& properties)
+    {
+      putInt(properties.size());
+
+      for (auto it = properties.begin(); it != properties.end(); ++it)
+      {
+        putString(it->first);
+        putString(it->second);
+      }
+    }
+
+    void putInts(const std::vector<int>& values)
+    {
+      putInt(values.size());
+
+      for (auto it = values.begin(); it != values.end(); ++it)
+      {
+        putInt(*it);
+      }
+    }
+
+    bool write(const std::string& fileName) const
+    {
+      std::ofstream file(fileName.c_str(), std::ios::binary);
+      if (!file)
+        return false;
+
+      // Header and string table first, then the data that refers to them.
+      std::vector<char> header;
+      auto putHeaderInt = [&header](int32_t value)
+      {
+        header.insert(header.end(), (const char*)&value, (const char*)&value + sizeof(value));
+      };
+
+      putHeaderInt(BINARY_MAGIC);
+      putHeaderInt(BINARY_VERSION);
+      putHeaderInt(m_strings.size());
+
+      for (auto it = m_strings.begin(); it != m_strings.end(); ++it)
+      {
+        putHeaderInt(it->size());
+        header.insert(header.end(), it->begin(), it->end());
+      }
+
+      file.write(&header[0], header.size());
+      file.write(m_data.empty() ? "" : &m_data[0], m_data.size());
+
+      return file.good();
+    }
+  private:
+    void put(const void* bytes, size_t size)
+    {
+      m_data.insert(m_data.end(), (const char*)bytes, (const char*)bytes + size);
+    }
+  private:
+    std::vector<char> m_data;
+    std::vector<std::string> m_strings;
+    std::map<std::string, int32_t> m_stringIds;
+  };
+
+  // Reads a compiled map from memory. Running past the end or referring to
+  // a string that doesn't exist sets the error flag, and every read after
+  // that returns zero or empty.
+  class BinaryReader
+  {
+  public:
+    BinaryReader(const std::vector<char>& data)
+     : m_data(data),
+       m_pos(0),
+       m_error(false)
+    {
+    }
+
+    bool good() const { return !m_error; }
+    void fail() { m_error = true; }
+
+    int32_t getInt()
+    {
+      int32_t value = 0;
+
+      if (m_error || m_pos + sizeof(value) > m_data.size())
+      {
+        m_error = true;
+        return 0;
+      }
+
+      memcpy(&value, &m_data[m_pos], sizeof(value));
+      m_pos += sizeof(value);
+
+      return value;
+    }
+
+    // Number of entries that follow, each at least entrySize bytes. Guards
+    // against allocating huge vectors for a corrupt file.
+    size_t getCount(size_t entrySize)
+    {
+      int32_t count = getInt();
+
+      if (count < 0 || (size_t)count * entrySize > m_data.size() - m_pos)
+      {
+        m_error = true;
+        return 0;
+      }
+
+      return count;
+    }
+
+    void readStrings()
+    {
+      size_t count = getCount(sizeof(int32_t));
+
+      for (size_t i = 0; i < count && good(); i++)
+      {
+        size_t length = getCount(1);
+
+        if (good())
+        {
+          m_strings.push_back(std::string(&m_data[0] + m_pos, length));
+          m_pos += length;
+        }
+      }
+    }
+
+    std::string getString()
+    {
+      int32_t id = getInt();
+
+      if (id < 0 || id >= (int32_t)m_strings.size())
+      {
+        m_error = true;
+        return "";
+      }
+
+      return m_strings[id];
+    }
+
+    void getProperties(std::map<std::string, std::string>& properties)
+    {
+      size_t count = getCount(2 * sizeof(int32_t));
+
+      for (size_t i = 0; i < count && good(); i++)
+      {
+        std::string key = getString();
+        properties[key] = getString();
+      }
+    }
+
+    void getInts(std::vector<int>& values)
+    {
+      size_t count = getCount(sizeof(int32_t));
+
+      values.resize(count);
+
+      if (count)
+      {
+        memcpy(&values[0], &m_data[m_pos], count * sizeof(int32_t));
+        m_pos += count * sizeof(int32_t);
+      }
+    }
+  private:
+    const std::vector<char>& m_data;
+    size_t m_pos;
+    bool m_error;
+
+    std::vector<std::string> m_strings;
+  };
+}
+
 TiledLoader::TiledLoader()
  : m_width(0),
    m_height(0),
@@ -20,6 +291,28 @@ TiledLoader::TiledLoader()
 
 }
 
+bool TiledLoader::load(const std::string& fileName)
+{
+  std::string binaryName = getBinaryFileName(fileName);
+
+  struct stat source, binary;
+
+  if (stat(binaryName.c_str(), &binary) == 0 &&
+      (stat(fileName.c_str(), &source) != 0 || binary.st_mtime > source.st_mtime))
+  {
+    if (loadFromBinary(binaryName))
+    {
+      return true;
+    }
+
+    TRACE("Unable to load compiled map %s, using %s", binaryName.c_str(), fileName.c_str());
+
+    clear();
+  }
+
+  return loadFromFile(fileName);
+}
+
 bool TiledLoader::loadFromFile(const std::string& fileName)
 {
   TRACE("Loading tiled XML map: %s", fileName.c_str());
@@ -30,6 +323,12 @@ bool TiledLoader::loadFromFile(const std::string& fileName)
   XMLElement* mapElement = doc.FirstChildElement("map");
   XMLElement* element = 0;
 
+  if (!mapElement)
+  {
+    TRACE("No map in %s", fileName.c_str());
+    return false;
+  }
+
   setMapAttributes(mapElement);
 
   for (element = mapElement->FirstChildElement(); element; element = element->NextSiblingElement())
@@ -58,6 +357,165 @@ bool TiledLoader::loadFromFile(const std::string& fileName)
   return true;
 }
 
+bool TiledLoader::loadFromBinary(const std::string& fileName)
+{
+  TRACE("Loading compiled map: %s", fileName.c_str());
+
+  std::vector<char> data;
+
+  if (FILE* file = fopen(fileName.c_str(), "rb"))
+  {
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if (size > 0)
+    {
+      data.resize(size);
+
+      if (fread(&data[0], 1, size, file) != (size_t)size)
+        data.clear();
+    }
+
+    fclose(file);
+  }
+
+  BinaryReader reader(data);
+
+  if ((uint32_t)reader.getInt() != BINARY_MAGIC || (uint32_t)reader.getInt() != BINARY_VERSION)
+  {
+    return false;
+  }
+
+  reader.readStrings();
+
+  m_orientation = reader.getString();
+  m_width = reader.getInt();
+  m_height = reader.getInt();
+  m_tileW = reader.getInt();
+  m_tileH = reader.getInt();
+
+  reader.getProperties(m_properties);
+
+  for (size_t i = reader.getCount(9 * sizeof(int32_t)); i > 0 && reader.good(); i--)
+  {
+    std::string name = reader.getString();
+
+    Tileset tileset;
+    tileset.tileW = reader.getInt();
+    tileset.tileH = reader.getInt();
+    tileset.startTileIndex = reader.getInt();
+    tileset.tilesetSource = reader.getString();
+    tileset.useColorKey = reader.getInt() != 0;
+    tileset.colorKey_r = reader.getInt();
+    tileset.colorKey_g = reader.getInt();
+    tileset.colorKey_b = reader.getInt();
+
+    m_tilesets[name] = tileset;
+  }
+
+  for (size_t i = reader.getCount(5 * sizeof(int32_t)); i > 0 && reader.good(); i--)
+  {
+    std::string name = reader.getString();
+
+    Layer& layer = m_layers[name];
+    layer.width = reader.getInt();
+    layer.height = reader.getInt();
+    reader.getProperties(layer.properties);
+    reader.getInts(layer.tiles);
+
+    if (layer.width < 0 || layer.height < 0 || layer.tiles.size() != (size_t)layer.width * layer.height)
+    {
+      reader.fail();
+    }
+  }
+
+  for (size_t i = reader.getCount(8 * sizeof(int32_t)); i > 0 && reader.good(); i--)
+  {
+    Object object;
+    object.name = reader.getString();
+    object.type = reader.getString();
+    object.x = reader.getInt();
+    object.y = reader.getInt();
+    object.width = reader.getInt();
+    object.height = reader.getInt();
+    object.tileId = reader.getInt();
+    reader.getProperties(object.properties);
+
+    m_objects.push_back(object);
+  }
+
+  return reader.good();
+}
+
+bool TiledLoader::saveBinary(const std::string& fileName) const
+{
+  BinaryWriter writer;
+
+  writer.putString(m_orientation);
+  writer.putInt(m_width);
+  writer.putInt(m_height);
+  writer.putInt(m_tileW);
+  writer.putInt(m_tileH);
+
+  writer.putProperties(m_properties);
+
+  writer.putInt(m_tilesets.size());
+  for (auto it = m_tilesets.begin(); it != m_tilesets.end(); ++it)
+  {
+    const Tileset& tileset = it->second;
+
+    writer.putString(it->first);
+    writer.putInt(tileset.tileW);
+    writer.putInt(tileset.tileH);
+    writer.putInt(tileset.startTileIndex);
+    writer.putString(tileset.tilesetSource);
+    writer.putInt(tileset.useColorKey);
+    writer.putInt(tileset.colorKey_r);
+    writer.putInt(tileset.colorKey_g);
+    writer.putInt(tileset.colorKey_b);
+  }
+
+  writer.putInt(m_layers.size());
+  for (auto it = m_layers.begin(); it != m_layers.end(); ++it)
+  {
+    const Layer& layer = it->second;
+
+    writer.putString(it->first);
+    writer.putInt(layer.width);
+    writer.putInt(layer.height);
+    writer.putProperties(layer.properties);
+    writer.putInts(layer.tiles);
+  }
+
+  writer.putInt(m_objects.size());
+  for (auto it = m_objects.begin(); it != m_objects.end(); ++it)
+  {
+    writer.putString(it->name);
+    writer.putString(it->type);
+    writer.putInt(it->x);
+    writer.putInt(it->y);
+    writer.putInt(it->width);
+    writer.putInt(it->height);
+    writer.putInt(it->tileId);
+    writer.putProperties(it->properties);
+  }
+
+  return writer.write(fileName);
+}
+
+void TiledLoader::clear()
+{
+  m_orientation.clear();
+  m_width = m_height = 0;
+  m_tileW = m_tileH = 0;
+
+  m_properties.clear();
+  m_layers.clear();
+  m_tilesets.clear();
+  m_objects.clear();
+}
+
 void TiledLoader::setMapAttributes(const tinyxml2::XMLElement* mapElement)
 {
  /* orientation: Map orientation. Tiled supports "orthogonal" and "isometric" at the moment.
@@ -245,13 +703,22 @@ void TiledLoader::parseLayer(const tinyxml2::XMLElement* element)
     parseProperties(propertyElement, layer.properties);
   }
 
-  if (std::string(encodingAttrib->Value()) == "csv")
+  const XMLAttribute* compressionAttrib = dataElement->FindAttribute("compression");
+  const char* text = dataElement->GetText();
+
+  std::string encoding = encodingAttrib ? encodingAttrib->Value() : "";
+
+  if (encoding == "csv")
+  {
+    layer.tiles = parseCsv(text ? text : "");
+  }
+  else if (encoding == "base64")
   {
-    layer.tiles = parseCsv(dataElement->GetText());
+    layer.tiles = parseBase64(text ? text : "", compressionAttrib ? compressionAttrib->Value() : "", layer.width * layer.height);
   }
   else
   {
-    std::cerr << "* Not supported encoding: " << encodingAttrib->Value() << std::endl;
+    std::cerr << "* Not supported encoding: " << (encoding.empty() ? "xml" : encoding) << std::endl;
   }
 
   m_layers[nameAttrib->Value()] = layer;
@@ -267,20 +734,24 @@ void TiledLoader::parseLayer(const tinyxml2::XMLElement* element)
 std::vector<int> TiledLoader::parseCsv(const std::string& csv) const
 {
   std::vector<int> tiles;
+  tiles.reserve(csv.size() / 2);
 
-  std::stringstream csvStream(csv);
+  const char* pos = csv.c_str();
 
-  std::string line;
-  while (std::getline(csvStream, line))
+  while (*pos)
   {
-    std::stringstream lineStream(line);
+    char* end;
+    long value = strtol(pos, &end, 10);
 
-    std::string element;
-    while (std::getline(lineStream, element, ','))
+    if (end == pos)
     {
-      int value = atoi(element.c_str());
-      tiles.push_back(value);
+      // Separator or whitespace.
+      pos++;
+      continue;
     }
+
+    tiles.push_back((int)value);
+    pos = end;
   }
 
   TRACE("* parseCsv: Read %d tile numbers.", tiles.size());
@@ -288,6 +759,76 @@ std::vector<int> TiledLoader::parseCsv(const std::string& csv) const
   return tiles;
 }
 
+std::vector<int> TiledLoader::parseBase64(const std::string& data, const std::string& compression, size_t numberOfTiles) const
+{
+  std::vector<unsigned char> bytes = _decode_base64(data);
+
+  // Every tile is a little endian 32 bit gid.
+  if (compression == "zlib" || compression == "gzip")
+  {
+    std::vector<unsigned char> compressed;
+    compressed.swap(bytes);
+    bytes.resize(numberOfTiles * 4);
+
+    if (!_inflate(compressed, bytes))
+    {
+      std::cerr << "* Unable to inflate " << compression << " layer data" << std::endl;
+      return std::vector<int>();
+    }
+  }
+  else if (compression == "zstd")
+  {
+#ifdef USE_ZSTD
+    std::vector<unsigned char> compressed;
+    compressed.swap(bytes);
+    bytes.resize(numberOfTiles * 4);
+
+    if (compressed.empty() || bytes.empty())
+    {
+      std::cerr << "* Empty zstd layer data" << std::endl;
+      return std::vector<int>();
+    }
+
+    size_t size = ZSTD_decompress(&bytes[0], bytes.size(), &compressed[0], compressed.size());
+
+    if (ZSTD_isError(size) || size != bytes.size())
+    {
+      std::cerr << "* Unable to decompress zstd layer data" << std::endl;
+      return std::vector<int>();
+    }
+#else
+    std::cerr << "* Not supported compression (build with USE_ZSTD): " << compression << std::endl;
+    return std::vector<int>();
+#endif
+  }
+  else if (!compression.empty())
+  {
+    std::cerr << "* Not supported compression: " << compression << std::endl;
+    return std::vector<int>();
+  }
+
+  // The map copies layers into width * height arrays, so anything else
+  // would write out of bounds.
+  if (bytes.size() != numberOfTiles * 4)
+  {
+    std::cerr << "* Layer data has " << bytes.size() / 4 << " tiles, expected " << numberOfTiles << std::endl;
+    return std::vector<int>();
+  }
+
+  std::vector<int> tiles(numberOfTiles);
+
+  for (size_t i = 0; i < tiles.size(); i++)
+  {
+    const unsigned char* gid = &bytes[i * 4];
+
+    tiles[i] = (int)((uint32_t)gid[0] | ((uint32_t)gid[1] << 8) | ((uint32_t)gid[2] << 16) | ((uint32_t)gid[3] << 24));
+  }
+
+  TRACE("* parseBase64: Read %d tile numbers.", tiles.size());
+
+  return tiles;
+}
+
 std::vector<std::string> TiledLoader::getLayers() const
 {
   std::vector<std::string> layers;
@@ -42,8 +42,25 @@ public:
   };
 public:
   TiledLoader();
+
+  /// Load the compiled version of fileName if it exists and is newer than
+  /// fileName, otherwise the TMX file itself. Modification times only have
+  /// a resolution of a second, so a tie goes to the TMX file.
+  bool load(const std::string& fileName);
+
   bool loadFromFile(const std::string& fileName);
 
+  /// Compiled maps, see saveBinary.
+  bool loadFromBinary(const std::string& fileName);
+
+  /// Write everything loaded to a compact binary file: dense layer arrays
+  /// and tables of tilesets and objects, with every string stored once.
+  /// It is read back with a single read.
+  bool saveBinary(const std::string& fileName) const;
+
+  /// Where the compiled version of a TMX file is kept.
+  static std::string getBinaryFileName(const std::string& fileName) { return fileName + ".bin"; }
+
   inline int getWidth() const { return m_width; }
   inline int getHeight() const { return m_height; }
   inline int getTileWidth() const { return m_tileW; }
@@ -87,6 +104,9 @@ private:
   void parseLayer(const tinyxml2::XMLElement* element);
 
   std::vector<int> parseCsv(const std::string& csv) const;
+  std::vector<int> parseBase64(const std::string& data, const std::string& compression, size_t numberOfTiles) const;
+
+  void clear();
 private:
   std::string m_orientation;
   int m_width;
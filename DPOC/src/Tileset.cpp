@@ -0,0 +1,54 @@
+#include "Tileset.h"
+
+Tileset::Tileset()
+ : m_tileWidth(0),
+   m_tileHeight(0),
+   m_columns(0),
+   m_rows(0)
+{
+}
+
+bool Tileset::loadFromFile(const std::string& filename, int tileWidth, int tileHeight)
+{
+  if (!m_image.loadFromFile(filename))
+    return false;
+
+  updateLayout(tileWidth, tileHeight);
+
+  return true;
+}
+
+void Tileset::create(const sf::Image& image, int tileWidth, int tileHeight)
+{
+  m_image = image;
+
+  updateLayout(tileWidth, tileHeight);
+}
+
+const sf::Uint8* Tileset::getTilePixels(int tileNum) const
+{
+  int tileX = tileNum % m_columns;
+  int tileY = tileNum / m_columns;
+
+  return m_image.getPixelsPtr() + (tileY * m_tileHeight) * getPitch() + tileX * m_tileWidth * 4;
+}
+
+void Tileset::copyTile(int tileNum, sf::Image& image) const
+{
+  if (tileNum < 0 || tileNum >= getNumberOfTiles())
+    return;
+
+  int tileX = tileNum % m_columns;
+  int tileY = tileNum / m_columns;
+
+  image.copy(m_image, 0, 0, sf::IntRect(tileX * m_tileWidth, tileY * m_tileHeight, m_tileWidth, m_tileHeight), true);
+}
+
+void Tileset::updateLayout(int tileWidth, int tileHeight)
+{
+  m_tileWidth = tileWidth;
+  m_tileHeight = tileHeight;
+
+  m_columns = tileWidth > 0 ? m_image.getSize().x / tileWidth : 0;
+  m_rows = tileHeight > 0 ? m_image.getSize().y / tileHeight : 0;
+}
@@ -0,0 +1,44 @@
+#ifndef TILESET_H
+#define TILESET_H
+
+#include <string>
+
+#include <SFML/Graphics.hpp>
+
+/**
+ * CPU side copy of a tileset image for the code that reads texels, i.e.
+ * the raycaster and tile sprites. The image is decoded once and tiles are
+ * read straight out of it instead of being copied to images of their own.
+ *
+ * Shared through cache::loadTileset.
+ */
+class Tileset
+{
+public:
+  Tileset();
+
+  bool loadFromFile(const std::string& filename, int tileWidth, int tileHeight);
+  void create(const sf::Image& image, int tileWidth, int tileHeight);
+
+  const sf::Image& getImage() const { return m_image; }
+
+  int getTileWidth() const { return m_tileWidth; }
+  int getTileHeight() const { return m_tileHeight; }
+  int getNumberOfTiles() const { return m_columns * m_rows; }
+
+  /// RGBA bytes of the top left texel of tile tileNum. The tile's rows are
+  /// getPitch() bytes apart.
+  const sf::Uint8* getTilePixels(int tileNum) const;
+  size_t getPitch() const { return m_image.getSize().x * 4; }
+
+  /// Copy tile tileNum to image, which must be one tile big.
+  void copyTile(int tileNum, sf::Image& image) const;
+private:
+  void updateLayout(int tileWidth, int tileHeight);
+private:
+  sf::Image m_image;
+  int m_tileWidth, m_tileHeight;
+  int m_columns, m_rows;
+};
+
+#endif
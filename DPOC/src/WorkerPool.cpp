@@ -0,0 +1,119 @@
+#include <algorithm>
+
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(int numberOfThreads)
+ : m_job(0),
+   m_count(0),
+   m_chunkSize(1),
+   m_nextChunk(0),
+   m_busyWorkers(0),
+   m_generation(0),
+   m_quit(false)
+{
+  for (int i = 1; i < numberOfThreads; i++)
+  {
+    m_threads.push_back(std::thread(&WorkerPool::workerLoop, this));
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+
+  m_startCondition.notify_all();
+
+  for (auto it = m_threads.begin(); it != m_threads.end(); ++it)
+  {
+    it->join();
+  }
+}
+
+void WorkerPool::parallelFor(int count, int chunkSize, const Job& job)
+{
+  if (m_threads.empty() || count <= chunkSize)
+  {
+    job(0, count);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_job = &job;
+    m_count = count;
+    m_chunkSize = chunkSize;
+    m_nextChunk = 0;
+    m_busyWorkers = m_threads.size();
+    m_generation++;
+  }
+
+  m_startCondition.notify_all();
+
+  // Help out instead of just waiting.
+  runChunks();
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_doneCondition.wait(lock, [this] { return m_busyWorkers == 0; });
+
+  m_job = 0;
+}
+
+void WorkerPool::workerLoop()
+{
+  unsigned lastGeneration = 0;
+
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_startCondition.wait(lock, [&] { return m_quit || m_generation != lastGeneration; });
+
+      if (m_quit)
+      {
+        return;
+      }
+
+      lastGeneration = m_generation;
+    }
+
+    runChunks();
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_busyWorkers--;
+    }
+
+    m_doneCondition.notify_one();
+  }
+}
+
+void WorkerPool::runChunks()
+{
+  while (true)
+  {
+    int begin = m_nextChunk.fetch_add(m_chunkSize);
+
+    if (begin >= m_count)
+    {
+      break;
+    }
+
+    (*m_job)(begin, std::min(begin + m_chunkSize, m_count));
+  }
+}
+
+int WorkerPool::resolveThreadCount(int configured)
+{
+  if (configured > 0)
+  {
+    return configured;
+  }
+
+  int cores = std::thread::hardware_concurrency();
+
+  return cores > 0 ? cores : 1;
+}
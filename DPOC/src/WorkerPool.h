@@ -0,0 +1,57 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+/**
+ * A fixed set of threads that are kept alive between jobs. parallelFor splits
+ * a range into chunks that are picked up by the workers and by the calling
+ * thread, and only returns when the whole range has been processed.
+ */
+class WorkerPool
+{
+public:
+  typedef std::function<void(int, int)> Job;
+
+  /// numberOfThreads includes the calling thread, so a pool of 4 starts 3
+  /// workers.
+  explicit WorkerPool(int numberOfThreads);
+  ~WorkerPool();
+
+  /// Call job(begin, end) for consecutive chunks of [0, count).
+  void parallelFor(int count, int chunkSize, const Job& job);
+
+  int getNumberOfThreads() const { return m_threads.size() + 1; }
+
+  /// Thread count to use for a configured value. 0 or less means one thread
+  /// per hardware core.
+  static int resolveThreadCount(int configured);
+private:
+  WorkerPool(const WorkerPool&);
+  WorkerPool& operator=(const WorkerPool&);
+
+  void workerLoop();
+  void runChunks();
+private:
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_startCondition;
+  std::condition_variable m_doneCondition;
+
+  const Job* m_job;
+  int m_count;
+  int m_chunkSize;
+  std::atomic<int> m_nextChunk;
+
+  int m_busyWorkers;
+  unsigned m_generation;
+  bool m_quit;
+};
+
+#endif
@@ -11,8 +11,16 @@ std::string getTimeStamp()
   time_t _time;
   time(&_time);
 
-  strncpy(timestr, ctime(&_time), 32);
-  timestr[strlen(timestr) - 1] = '\0';
+  // Not ctime or localtime, traces come from more than one thread and
+  // those share a static buffer.
+  tm timeinfo;
+#ifdef _WIN32
+  localtime_s(&timeinfo, &_time);
+#else
+  localtime_r(&_time, &timeinfo);
+#endif
+
+  strftime(timestr, sizeof(timestr), "%a %b %d %H:%M:%S %Y", &timeinfo);
 
   return timestr;
 }
@@ -25,7 +33,8 @@ Logger& Logger::instance()
 
 Logger::Logger()
 : m_logFile(0),
-  m_console(0)
+  m_console(0),
+  m_mainThread(std::this_thread::get_id())
 {
   m_logFile = fopen("log.txt", "w");
   fclose(m_logFile);
@@ -51,11 +60,13 @@ void Logger::trace(const char* file, int line, const char* fmt, ...)
   std::ostringstream stream;
   stream << "[" << getTimeStamp() << "] " << file << ":" << line << ": " << buffer << "\n";
 
+  std::lock_guard<std::mutex> lock(m_mutex);
+
   m_logFile = fopen("log.txt", "a");
   fprintf(m_logFile, "%s", stream.str().c_str());
   fclose(m_logFile);
 
-  if (m_console)
+  if (m_console && std::this_thread::get_id() == m_mainThread)
   {
     m_console->add(buffer);
   }
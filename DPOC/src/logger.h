@@ -4,6 +4,8 @@
 #include <cstdio>
 #include <ctime>
 #include <cstring>
+#include <mutex>
+#include <thread>
 
 class Console;
 
@@ -20,6 +22,10 @@ private:
 private:
   FILE* m_logFile;
   Console* m_console;
+
+  // Traces may come from background threads. Those only go to the file.
+  std::mutex m_mutex;
+  std::thread::id m_mainThread;
 };
 
 #define START_LOG Logger::instance();
@@ -0,0 +1,595 @@
+/*
+ * Headless raycaster benchmark.
+ *
+ * Loads a map without opening a window and renders it along a few scripted
+ * camera paths: the longest straight corridor, a full turn on the spot and
+ * an approach to every door while it opens. Frame times and a per stage
+ * breakdown are printed for every path.
+ *
+ * Every frame is hashed and compared against the golden checksums in
+ * tools/bench/golden/, so a change that alters the rendered output is
+ * noticed. A map without golden checksums fails as well. Run with --record
+ * to write the golden file after an intended change.
+ *
+ * Usage, from the DPOC directory:
+ *
+ *   ./RaycasterBench [--record] [--threads n] [--floor columns|scanlines] [--fixed] [--indexed] Maps/Dungeon.tmx ...
+ *
+ * Map names are relative to Resources/. tools/bench/data/Bench.tmx, passed
+ * as ../tools/bench/data/Bench.tmx, is a small map with its own tileset
+ * that has golden checksums for every mode.
+ */
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "../../src/logger.h"
+#include "../../src/Config.h"
+#include "../../src/Scenario.h"
+#include "../../src/Utility.h"
+#include "../../src/Camera.h"
+#include "../../src/Direction.h"
+#include "../../src/Map.h"
+#include "../../src/Entity.h"
+#include "../../src/Door.h"
+#include "../../src/Raycaster.h"
+
+namespace
+{
+  typedef std::chrono::steady_clock BenchClock;
+
+  const std::string GOLDEN_DIR = "tools/bench/golden/";
+
+  // Camera movement per frame.
+  const float WALK_STEP = 0.05f;
+  const float TURN_STEP = 1.0f;
+  const float DOOR_SWEEP = 20.0f;
+  const int DOOR_FRAMES = 60;
+
+  struct Frame
+  {
+    Camera camera;
+    Door* openDoor; // Door to start opening before the first frame, if any.
+  };
+
+  struct Path
+  {
+    std::string name;
+    std::vector<Frame> frames;
+  };
+
+  struct Result
+  {
+    std::vector<int64_t> frameTimes;
+    Raycaster::Stats stats;
+    std::vector<uint64_t> checksums;
+  };
+
+  bool _is_wall(const Map* map, int x, int y)
+  {
+    if (x < 0 || y < 0 || x >= map->getWidth() || y >= map->getHeight())
+      return true;
+
+    const Tile* tile = map->getTileAt(x, y, LAYER_WALL);
+
+    return tile && tile->tileId != -1;
+  }
+
+  /// A camera at the center of tile (x, y) facing dir.
+  Camera _make_camera(float x, float y, Direction dir)
+  {
+    Camera camera(Vec2(x + 0.5f, y + 0.5f), Vec2(-1, 0), Vec2(0, -0.66f));
+
+    if (dir == DIR_UP)
+      camera.rotate(deg2rad(90));
+    else if (dir == DIR_RIGHT)
+      camera.rotate(deg2rad(180));
+    else if (dir == DIR_DOWN)
+      camera.rotate(deg2rad(-90));
+
+    return camera;
+  }
+
+  /// Direction sprites are seen from, as the player would face.
+  Direction _facing(const Camera& camera)
+  {
+    if (fabs(camera.dir.x) > fabs(camera.dir.y))
+      return camera.dir.x < 0 ? DIR_LEFT : DIR_RIGHT;
+
+    return camera.dir.y < 0 ? DIR_UP : DIR_DOWN;
+  }
+
+  Frame _make_frame(const Camera& camera, Door* openDoor = 0)
+  {
+    Frame frame = { camera, openDoor };
+    return frame;
+  }
+
+  Path _corridor_path(const Map* map, int& centerX, int& centerY)
+  {
+    int bestLength = 0;
+    int bestX = 0, bestY = 0;
+    bool horizontal = true;
+
+    for (int y = 0; y < map->getHeight(); y++)
+    {
+      for (int x = 0; x < map->getWidth(); x++)
+      {
+        if (_is_wall(map, x, y))
+          continue;
+
+        int length = 0;
+        while (!_is_wall(map, x + length, y))
+          length++;
+
+        if (length > bestLength)
+        {
+          bestLength = length;
+          bestX = x;
+          bestY = y;
+          horizontal = true;
+        }
+
+        length = 0;
+        while (!_is_wall(map, x, y + length))
+          length++;
+
+        if (length > bestLength)
+        {
+          bestLength = length;
+          bestX = x;
+          bestY = y;
+          horizontal = false;
+        }
+      }
+    }
+
+    Path path;
+    path.name = "corridor";
+
+    centerX = bestX + (horizontal ? bestLength / 2 : 0);
+    centerY = bestY + (horizontal ? 0 : bestLength / 2);
+
+    for (float t = 0; t <= bestLength - 1; t += WALK_STEP)
+    {
+      if (horizontal)
+        path.frames.push_back(_make_frame(_make_camera(bestX + t, bestY, DIR_RIGHT)));
+      else
+        path.frames.push_back(_make_frame(_make_camera(bestX, bestY + t, DIR_DOWN)));
+    }
+
+    return path;
+  }
+
+  Path _spin_path(int x, int y)
+  {
+    Path path;
+    path.name = "spin";
+
+    Camera camera = _make_camera(x, y, DIR_LEFT);
+
+    for (float angle = 0; angle < 360; angle += TURN_STEP)
+    {
+      path.frames.push_back(_make_frame(camera));
+      camera.rotate(deg2rad(TURN_STEP));
+    }
+
+    return path;
+  }
+
+  Path _door_path(const Map* map)
+  {
+    Path path;
+    path.name = "doors";
+
+    static const int dx[] = { 1, -1, 0, 0 };
+    static const int dy[] = { 0, 0, 1, -1 };
+    static const Direction facing[] = { DIR_LEFT, DIR_RIGHT, DIR_UP, DIR_DOWN };
+
+    for (auto it = map->getEntities().begin(); it != map->getEntities().end(); ++it)
+    {
+      if ((*it)->getType() != "door")
+        continue;
+
+      Door* door = static_cast<Door*>(*it);
+
+      for (int side = 0; side < 4; side++)
+      {
+        int x = (int)door->x + dx[side];
+        int y = (int)door->y + dy[side];
+
+        if (_is_wall(map, x, y))
+          continue;
+
+        // Back off one more tile if there's room, so the door frame is seen.
+        if (!_is_wall(map, x + dx[side], y + dy[side]))
+        {
+          x += dx[side];
+          y += dy[side];
+        }
+
+        for (int i = 0; i < DOOR_FRAMES; i++)
+        {
+          Camera camera = _make_camera(x, y, facing[side]);
+          camera.rotate(deg2rad(-DOOR_SWEEP + 2 * DOOR_SWEEP * i / (DOOR_FRAMES - 1)));
+
+          path.frames.push_back(_make_frame(camera, i == 0 ? door : 0));
+        }
+      }
+    }
+
+    return path;
+  }
+
+  uint64_t _checksum(const Raycaster& raycaster)
+  {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    const sf::Uint8* pixels = raycaster.getPixels();
+    const size_t size = raycaster.getWidth() * raycaster.getHeight() * 4;
+
+    for (size_t i = 0; i < size; i++)
+    {
+      hash = (hash ^ pixels[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+  }
+
+  void _close_doors(const Map* map)
+  {
+    for (auto it = map->getEntities().begin(); it != map->getEntities().end(); ++it)
+    {
+      if ((*it)->getType() == "door")
+      {
+        Door* door = static_cast<Door*>(*it);
+        door->close();
+
+        for (int i = 0; i < 1000 && door->isSeeThrough(); i++)
+          door->update();
+      }
+    }
+  }
+
+  void _run_frames(Raycaster& raycaster, const Map* map, const Path& path, Result& result, bool profile)
+  {
+    Door* activeDoor = 0;
+
+    _close_doors(map);
+
+    raycaster.setProfiling(profile);
+
+    for (size_t i = 0; i < path.frames.size(); i++)
+    {
+      Frame frame = path.frames[i];
+
+      if (frame.openDoor)
+      {
+        if (activeDoor)
+          _close_doors(map);
+
+        activeDoor = frame.openDoor;
+        activeDoor->open();
+      }
+
+      if (activeDoor)
+        activeDoor->update();
+
+      BenchClock::time_point start = BenchClock::now();
+      raycaster.raycast(&frame.camera, _facing(frame.camera));
+      BenchClock::time_point end = BenchClock::now();
+
+      if (profile)
+      {
+        const Raycaster::Stats& stats = raycaster.getStats();
+
+        result.stats.walls += stats.walls;
+        result.stats.floors += stats.floors;
+        result.stats.doors += stats.doors;
+        result.stats.sprites += stats.sprites;
+      }
+      else
+      {
+        result.frameTimes.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        result.checksums.push_back(_checksum(raycaster));
+      }
+    }
+
+    raycaster.setProfiling(false);
+  }
+
+  int64_t _percentile(const std::vector<int64_t>& sorted, int percent)
+  {
+    if (sorted.empty())
+      return 0;
+
+    size_t index = std::min(sorted.size() - 1, (sorted.size() * percent) / 100);
+    return sorted[index];
+  }
+
+  void _report(const Path& path, const Result& result)
+  {
+    std::vector<int64_t> sorted = result.frameTimes;
+    std::sort(sorted.begin(), sorted.end());
+
+    int frames = std::max((size_t)1, path.frames.size());
+
+    printf("  %-10s %5d frames  p50 %9lld  p90 %9lld  p99 %9lld  max %9lld ns\n",
+        path.name.c_str(), (int)path.frames.size(),
+        (long long)_percentile(sorted, 50),
+        (long long)_percentile(sorted, 90),
+        (long long)_percentile(sorted, 99),
+        (long long)(sorted.empty() ? 0 : sorted.back()));
+
+    printf("  %-10s walls %9lld  floors %9lld  doors %9lld  sprites %9lld ns/frame\n", "",
+        (long long)(result.stats.walls / frames),
+        (long long)(result.stats.floors / frames),
+        (long long)(result.stats.doors / frames),
+        (long long)(result.stats.sprites / frames));
+  }
+
+  std::string _golden_file(const std::string& mapName, const Raycaster& raycaster)
+  {
+    std::string name = mapName.substr(mapName.find_last_of('/') + 1);
+    name = name.substr(0, name.find_last_of('.'));
+
+    name += "_" + toString(raycaster.getWidth()) + "x" + toString(raycaster.getHeight());
+
+    // Scanline floors step through the texture differently.
+    if (raycaster.getFloorMode() == Raycaster::FLOOR_SCANLINES)
+      name += "_scanlines";
+
+    // The fixed point path is allowed to differ slightly from the float one.
+    if (raycaster.getFixedPoint())
+      name += "_fixed";
+
+    if (raycaster.getIndexed())
+      name += "_indexed";
+
+    return GOLDEN_DIR + name + ".txt";
+  }
+
+  /// Golden checksums keyed by "path frame".
+  bool _load_golden(const std::string& filename, std::map<std::string, uint64_t>& golden)
+  {
+    std::ifstream file(filename.c_str());
+
+    if (!file.is_open())
+      return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+      if (line.empty() || line[0] == '#')
+        continue;
+
+      std::istringstream ss(line);
+      std::string path;
+      int frame;
+      uint64_t checksum;
+
+      if (ss >> path >> frame >> std::hex >> checksum)
+      {
+        golden[path + " " + toString(frame)] = checksum;
+      }
+    }
+
+    return true;
+  }
+
+  bool _save_golden(const std::string& filename, const std::vector<Path>& paths, const std::vector<Result>& results)
+  {
+    std::ofstream file(filename.c_str());
+
+    if (!file.is_open())
+      return false;
+
+    file << "# path frame checksum\n";
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+      for (size_t j = 0; j < results[i].checksums.size(); j++)
+      {
+        char checksum[17];
+        snprintf(checksum, sizeof(checksum), "%016llx", (unsigned long long)results[i].checksums[j]);
+
+        file << paths[i].name << " " << j << " " << checksum << "\n";
+      }
+    }
+
+    return true;
+  }
+
+  /// Returns the number of frames that differ from the golden file.
+  int _compare_golden(const std::map<std::string, uint64_t>& golden, const std::vector<Path>& paths, const std::vector<Result>& results)
+  {
+    int mismatches = 0;
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+      for (size_t j = 0; j < results[i].checksums.size(); j++)
+      {
+        auto it = golden.find(paths[i].name + " " + toString(j));
+
+        if (it == golden.end() || it->second != results[i].checksums[j])
+        {
+          if (mismatches == 0)
+          {
+            printf("  first mismatch: %s frame %d\n", paths[i].name.c_str(), (int)j);
+          }
+
+          mismatches++;
+        }
+      }
+    }
+
+    return mismatches;
+  }
+
+  int _bench_map(const std::string& mapName, bool record, int width, int height)
+  {
+    Map* map = Map::loadTiledFile(mapName);
+
+    if (!map)
+    {
+      fprintf(stderr, "Unable to load map %s\n", mapName.c_str());
+      return 1;
+    }
+
+    Raycaster raycaster(width, height);
+    raycaster.setTilemap(map);
+
+    for (auto it = map->getEntities().begin(); it != map->getEntities().end(); ++it)
+    {
+      if ((*it)->getType() == "door")
+      {
+        raycaster.addDoor(static_cast<Door*>(*it));
+      }
+      else if ((*it)->sprite())
+      {
+        raycaster.addEntity(*it);
+      }
+    }
+
+    int centerX, centerY;
+
+    std::vector<Path> paths;
+    paths.push_back(_corridor_path(map, centerX, centerY));
+    paths.push_back(_spin_path(centerX, centerY));
+    paths.push_back(_door_path(map));
+
+    printf("%s (%dx%d, %s%s%s)\n", mapName.c_str(), width, height,
+        raycaster.getFloorMode() == Raycaster::FLOOR_SCANLINES ? "scanlines" : "columns",
+        raycaster.getFixedPoint() ? ", fixed point" : "",
+        raycaster.getIndexed() ? ", indexed" : "");
+
+    std::vector<Result> results(paths.size());
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+      if (paths[i].frames.empty())
+        continue;
+
+      // Warm up caches before timing.
+      Camera warmup = paths[i].frames[0].camera;
+      raycaster.raycast(&warmup, _facing(warmup));
+
+      _run_frames(raycaster, map, paths[i], results[i], false);
+      _run_frames(raycaster, map, paths[i], results[i], true);
+
+      _report(paths[i], results[i]);
+    }
+
+    int status = 0;
+    std::string goldenFile = _golden_file(mapName, raycaster);
+
+    if (record)
+    {
+      if (_save_golden(goldenFile, paths, results))
+      {
+        printf("  recorded %s\n", goldenFile.c_str());
+      }
+      else
+      {
+        fprintf(stderr, "  unable to write %s\n", goldenFile.c_str());
+        status = 1;
+      }
+    }
+    else
+    {
+      std::map<std::string, uint64_t> golden;
+
+      if (!_load_golden(goldenFile, golden))
+      {
+        printf("  FAILED: no golden checksums in %s, run with --record to create them\n", goldenFile.c_str());
+        status = 1;
+      }
+      else
+      {
+        int mismatches = _compare_golden(golden, paths, results);
+
+        if (mismatches)
+        {
+          printf("  FAILED: %d frames differ from %s\n", mismatches, goldenFile.c_str());
+          status = 1;
+        }
+        else
+        {
+          printf("  all frames match %s\n", goldenFile.c_str());
+        }
+      }
+    }
+
+    delete map;
+
+    return status;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  START_LOG;
+
+  Scenario::instance();
+  config::load_config();
+
+  bool record = false;
+  std::vector<std::string> maps;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+
+    if (arg == "--record")
+    {
+      record = true;
+    }
+    else if (arg == "--threads" && i + 1 < argc)
+    {
+      config::set("RAYCASTER_THREADS", argv[++i]);
+    }
+    else if (arg == "--floor" && i + 1 < argc)
+    {
+      config::set("RAYCASTER_FLOOR_MODE", argv[++i]);
+    }
+    else if (arg == "--fixed")
+    {
+      config::set("RAYCASTER_FIXED_POINT", "true");
+    }
+    else if (arg == "--indexed")
+    {
+      config::set("RAYCASTER_INDEXED", "true");
+    }
+    else
+    {
+      maps.push_back(arg);
+    }
+  }
+
+  if (maps.empty())
+  {
+    fprintf(stderr, "Usage: %s [--record] [--threads n] [--floor columns|scanlines] [--fixed] [--indexed] map.tmx ...\n", argv[0]);
+    return 1;
+  }
+
+  int width = config::getInt("RAYCASTER_WIDTH", config::RAYCASTER_RES_X);
+  int height = config::getInt("RAYCASTER_HEIGHT", config::RAYCASTER_RES_Y);
+
+  int status = 0;
+
+  for (size_t i = 0; i < maps.size(); i++)
+  {
+    status |= _bench_map(maps[i], record, width, height);
+  }
+
+  return status;
+}
@@ -0,0 +1,112 @@
+/*
+ * Map compiler.
+ *
+ * Compiles Tiled maps to the binary format written by
+ * TiledLoader::saveBinary. The compiled map is stored next to the TMX file
+ * and loaded instead of it for as long as it is newer.
+ *
+ * Usage, from the DPOC directory:
+ *
+ *   ./MapCompiler                  compiles every .tmx in Resources/Maps
+ *   ./MapCompiler path/to/map.tmx ...
+ */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <dirent.h>
+
+#include "../../src/logger.h"
+#include "../../src/Config.h"
+#include "../../src/TiledLoader.h"
+
+namespace
+{
+  bool _ends_with(const std::string& str, const std::string& suffix)
+  {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  std::vector<std::string> _find_maps(const std::string& directory)
+  {
+    std::vector<std::string> maps;
+
+    if (DIR* dir = opendir(directory.c_str()))
+    {
+      while (dirent* entry = readdir(dir))
+      {
+        std::string name = entry->d_name;
+
+        if (_ends_with(name, ".tmx"))
+        {
+          maps.push_back(directory + name);
+        }
+      }
+
+      closedir(dir);
+    }
+
+    std::sort(maps.begin(), maps.end());
+
+    return maps;
+  }
+
+  bool _compile(const std::string& fileName)
+  {
+    if (FILE* file = fopen(fileName.c_str(), "r"))
+    {
+      fclose(file);
+    }
+    else
+    {
+      fprintf(stderr, "%s: no such file\n", fileName.c_str());
+      return false;
+    }
+
+    TiledLoader loader;
+
+    if (!loader.loadFromFile(fileName))
+    {
+      fprintf(stderr, "%s: unable to load\n", fileName.c_str());
+      return false;
+    }
+
+    std::string binaryName = TiledLoader::getBinaryFileName(fileName);
+
+    if (!loader.saveBinary(binaryName))
+    {
+      fprintf(stderr, "%s: unable to write\n", binaryName.c_str());
+      return false;
+    }
+
+    printf("%s -> %s\n", fileName.c_str(), binaryName.c_str());
+
+    return true;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  START_LOG;
+
+  std::vector<std::string> maps(argv + 1, argv + argc);
+
+  if (maps.empty())
+  {
+    maps = _find_maps(config::res_path("Maps/"));
+  }
+
+  int failures = 0;
+
+  for (auto it = maps.begin(); it != maps.end(); ++it)
+  {
+    if (!_compile(*it))
+    {
+      failures++;
+    }
+  }
+
+  return failures == 0 ? 0 : 1;
+}